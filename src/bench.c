@@ -0,0 +1,212 @@
+/*
+ *  Headless benchmark of the menu renderer.
+ *
+ *  Runs FK_RunMenu on the SDL dummy video driver at 16 and 32 bpp, replaying scripted key sequences
+ *  through the menu frame callback, and reports init time, refresh time and bytes blitted for each.
+ *  It is built as its own executable along with menu.cpp and scaler.cpp, in place of main.c, e.g.:
+ *    g++ -O2 -std=c++14 -c src/menu.cpp src/scaler.cpp
+ *    gcc -O2 -o menu_bench src/bench.c menu.o scaler.o -lSDL_image -lSDL_ttf -lSDL -lstdc++ -lpthread
+ *  per stage figures need -DMENU_PROFILE on menu.cpp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL.h>
+
+#include "menu.h"
+
+#ifdef _WIN32
+/* SDL 1.2 libraries built with older MSVC runtimes still import it, the array must outlive the call */
+FILE* __cdecl __iob_func(void)
+{
+  static FILE _iob[3];
+  _iob[0] = *stdin;
+  _iob[1] = *stdout;
+  _iob[2] = *stderr;
+  return _iob;
+}
+#endif
+
+typedef struct {
+  SDLKey key;
+  int repeat;
+} BenchStep;
+
+typedef struct {
+  const char* name;
+  int zone;                 /* ENUM_MENU_TYPE the steps apply to, -1 for the zone shown */
+  const BenchStep* steps;
+  int nb_steps;
+} BenchScenario;
+
+#define BENCH_MAX_STEPS 8
+
+typedef struct {
+  const BenchScenario* scenario;
+  BenchStep steps[BENCH_MAX_STEPS];
+  int nb_steps;
+  int step;
+  int count;
+  int frames;
+  int done;
+} BenchState;
+
+/* scripts leave the menu on the zone they started from, the first one */
+static const BenchStep scroll_steps[] = { { SDLK_DOWN, 16 }, { SDLK_UP, 16 } };
+static const BenchStep volume_steps[] = { { SDLK_RIGHT, 20 }, { SDLK_LEFT, 20 } };
+static const BenchStep aspect_steps[] = { { SDLK_RIGHT, 8 } };
+
+#define SCENARIO(name, zone, steps) { name, zone, steps, sizeof(steps) / sizeof(steps[0]) }
+
+static const BenchScenario scenarios[] = {
+  SCENARIO("scroll zones", -1, scroll_steps),
+  SCENARIO("hold volume", MENU_TYPE_VOLUME, volume_steps),
+  SCENARIO("aspect ratio", MENU_TYPE_ASPECT_RATIO, aspect_steps),
+};
+
+/* wraps the steps of a scenario between scrolls down to its zone and back, whatever the zone order.
+   Returns -1 if the zone is not shown */
+static int bench_prepare(BenchState* state, const BenchScenario* scenario)
+{
+  int index = scenario->zone >= 0 ? FK_GetMenuZoneIndex(scenario->zone) : 0;
+  if (index < 0 || scenario->nb_steps + 2 > BENCH_MAX_STEPS)
+    return -1;
+
+  memset(state, 0, sizeof(*state));
+  state->scenario = scenario;
+  if (index > 0) {
+    state->steps[state->nb_steps].key = SDLK_DOWN;
+    state->steps[state->nb_steps++].repeat = index;
+  }
+  memcpy(state->steps + state->nb_steps, scenario->steps, scenario->nb_steps * sizeof(BenchStep));
+  state->nb_steps += scenario->nb_steps;
+  if (index > 0) {
+    state->steps[state->nb_steps].key = SDLK_UP;
+    state->steps[state->nb_steps++].repeat = index;
+  }
+  return 0;
+}
+
+static void push_key(SDLKey key)
+{
+  SDL_Event event;
+  memset(&event, 0, sizeof(event));
+  event.type = SDL_KEYDOWN;
+  event.key.type = SDL_KEYDOWN;
+  event.key.state = SDL_PRESSED;
+  event.key.keysym.sym = key;
+  SDL_PushEvent(&event);
+}
+
+/* feeds the next key once the menu has handled the previous one, then leaves the menu */
+static void bench_frame(int animating, void* userdata)
+{
+  BenchState* state = (BenchState*)userdata;
+
+  state->frames++;
+  if (animating || state->done)
+    return;
+
+  if (state->step == state->nb_steps) {
+    push_key(SDLK_ESCAPE);
+    state->done = 1;
+    return;
+  }
+
+  push_key(state->steps[state->step].key);
+  if (++state->count == state->steps[state->step].repeat) {
+    state->step++;
+    state->count = 0;
+  }
+}
+
+static void print_stat(const char* name, const FK_MenuStat* stat)
+{
+  printf("    %-14s %7u calls  avg %7.1f us  p99 %7u us  max %7u us", name, stat->count,
+    stat->count ? (double)stat->total_us / stat->count : 0.0, stat->p99_us, stat->max_us);
+  if (stat->bytes)
+    printf("  %10.1f KiB", stat->bytes / 1024.0);
+  printf("\n");
+}
+
+static void print_stats(void)
+{
+  FK_MenuStat stats[NB_MENU_STATS];
+  if (FK_GetMenuStats(stats, NB_MENU_STATS) < NB_MENU_STATS) {
+    printf("    (build with MENU_PROFILE for details)\n");
+    return;
+  }
+
+  print_stat("init", &stats[MENU_STAT_INIT]);
+  print_stat("open", &stats[MENU_STAT_OPEN]);
+  print_stat("refresh", &stats[MENU_STAT_REFRESH]);
+  print_stat("blit", &stats[MENU_STAT_BLIT]);
+  print_stat("text", &stats[MENU_STAT_TEXT]);
+}
+
+static int bench_depth(int bpp)
+{
+  if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+    printf("SDL_Init failed: %s\n", SDL_GetError());
+    return -1;
+  }
+
+  SDL_Surface* screen = SDL_SetVideoMode(240, 240, bpp, SDL_SWSURFACE);
+  if (!screen) {
+    printf("SDL_SetVideoMode failed: %s\n", SDL_GetError());
+    SDL_Quit();
+    return -1;
+  }
+
+  printf("%d bpp\n", screen->format->BitsPerPixel);
+
+  /* render as fast as possible, frame pacing would only measure the pacer */
+  FK_SetMenuFPS(0);
+
+  FK_ResetMenuStats();
+  Uint32 start = SDL_GetTicks();
+  FK_InitMenu();
+  printf("  init: %u ms\n", SDL_GetTicks() - start);
+  print_stats();
+
+  for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    BenchState state;
+    if (bench_prepare(&state, &scenarios[i])) {
+      printf("  %s: zone not shown, skipped\n", scenarios[i].name);
+      continue;
+    }
+
+    FK_SetMenuFrameCallback(bench_frame, &state);
+    FK_ResetMenuStats();
+
+    start = SDL_GetTicks();
+    FK_RunMenu(screen);
+    Uint32 elapsed = SDL_GetTicks() - start;
+
+    printf("  %s: %d frames in %u ms\n", state.scenario->name, state.frames, elapsed);
+    print_stats();
+  }
+
+  FK_SetMenuFrameCallback(NULL, NULL);
+  FK_EndMenu();
+  SDL_Quit();
+  return 0;
+}
+
+int main(void)
+{
+  static const int depths[] = { 16, 32 };
+
+  /* no window and no change to the host volume or backlight */
+  if (!getenv("SDL_VIDEODRIVER"))
+    SDL_putenv("SDL_VIDEODRIVER=dummy");
+  SDL_putenv(MENU_ENV_DETACHED_SYSTEM_CONTROL "=1");
+
+  for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+    if (bench_depth(depths[i]))
+      return -1;
+  }
+
+  return 0;
+}
@@ -17,6 +17,9 @@ int main(int argc, char* argv[])
 
   SDL_Surface* surface = SDL_SetVideoMode(240, 240, 32, SDL_HWSURFACE | SDL_DOUBLEBUF);
 
+  /* menu is prepared once in background, each hotkey press only opens it */
+  FK_InitMenuAsync();
+
   int exit = 0;
   SDL_Event event;
 
@@ -31,11 +34,9 @@ int main(int argc, char* argv[])
         {
           if (event.key.keysym.sym == SDLK_ESCAPE)
             exit = 1;
-        }
-        case SDLK_h:
-        {
-          FK_InitMenu();
-          FK_RunMenu(surface);
+          else if (event.key.keysym.sym == SDLK_h)
+            FK_RunMenu(surface);
+          break;
         }
       }
     }
@@ -50,6 +51,8 @@ int main(int argc, char* argv[])
 
 
 
+  FK_EndMenu();
+
   SDL_FreeSurface(surface);
   SDL_Quit();
 
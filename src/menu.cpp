@@ -29,9 +29,18 @@
  */
 
 #include "menu.h"
+#include "scaler.h"
 
 //#define MENU_DEBUG
 #define MENU_ERROR
+//#define MENU_PROFILE
+//#define MENU_PROFILE_DUMP
+//#define HAS_LZ4                 /* compresses save state deltas, needs liblz4 */
+//#define HAS_ALSA_MIXER          /* volume through the ALSA mixer instead of the shell, needs libasound */
+
+#ifdef _WIN32
+#undef HAS_ALSA_MIXER
+#endif
 
 #ifdef MENU_DEBUG
 #define MENU_DEBUG_PRINTF(...)   printf(__VA_ARGS__);
@@ -49,1419 +58,5462 @@
 #include <string>
 #include <functional>
 #include <array>
+#include <unordered_map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAS_ALSA_MIXER
+#include <alsa/asoundlib.h>
+#endif
+
+#ifdef HAS_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef MENU_PROFILE
+#include <chrono>
+#endif
 
 using path_t = std::string;
 
-#if defined(_WIN32)
-struct Platform
+/// -------------- DEFINES --------------
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+/// -------------- CONFIGURATION --------------
+
+/* geometry of the menu for one screen size. Zones are screen-sized, positions below are relative to a zone */
+struct MenuLayout
 {
-  static FILE* platformPopen(const char* command, const char* type) { return nullptr; }
-  static path_t resourcePath() { return ""; }
+  int screenWidth;
+  int screenHeight;
+  int squareWidth;          /* opaque square of the zone background */
+  int squareHeight;
+  int lineSpacing;          /* between text lines, the zone center being line 0 */
+  int barWidth;
+  int barHeight;
+  int scrollSpeed;          /* in pixels per frame */
+
+  constexpr int zoneWidth() const { return screenWidth; }
+  constexpr int zoneHeight() const { return screenHeight; }
+  constexpr int centerY() const { return zoneHeight() / 2; }
+  constexpr int lineY(int line, int height) const { return centerY() - height / 2 + lineSpacing * line; }
+  constexpr int centeredX(int width) const { return (zoneWidth() - width) / 2; }
+  constexpr int barX() const { return centeredX(barWidth); }
+  constexpr int barY() const { return lineY(1, barHeight); }
+  constexpr int thumbnailY() const { return centerY() + lineSpacing * 3 / 2; }
+  /* arrows are centered in the margins left by the square */
+  constexpr int arrowTopY(int height) const { return (screenHeight - squareHeight) / 4 - height / 2; }
+  constexpr int arrowBottomY(int height) const { return screenHeight - (screenHeight - squareHeight) / 4 - height / 2; }
+  constexpr int scrollStep(int scroll) const { return MIN(scrollSpeed, zoneHeight() - scroll); }
+
+  /* proportions of the original 240x240 layout */
+  static constexpr MenuLayout forScreen(int width, int height)
+  {
+    return { width, height, width * 3 / 4, height * 7 / 12, height * 3 / 40, width * 5 / 12, height / 12, height / 8 };
+  }
 };
-#else
-struct Platform
+
+static constexpr MenuLayout menu_layout = MenuLayout::forScreen(FK_MENU_SCREEN_WIDTH, FK_MENU_SCREEN_HEIGHT);
+static_assert(menu_layout.lineSpacing > 0 && menu_layout.barHeight > 0 && menu_layout.scrollSpeed > 0, "screen too small for the menu");
+
+#ifndef FK_MENU_ZONE_LIST
+#define FK_MENU_ZONE_LIST MENU_TYPE_VOLUME, MENU_TYPE_BRIGHTNESS, MENU_TYPE_SAVE, MENU_TYPE_LOAD, MENU_TYPE_ASPECT_RATIO, \
+  MENU_TYPE_RO_RW, MENU_TYPE_EXIT, MENU_TYPE_USB, MENU_TYPE_THEME, MENU_TYPE_LAUNCHER, MENU_TYPE_POWERDOWN
+#endif
+
+/* zones compiled in, code of the others is left out by their HAS_MENU_ flag */
+static constexpr bool menu_zone_enabled(int type)
 {
-  static FILE* platformPopen(const char* command, const char* type) { return popen(command, type); }
-  static path_t resourcePath() { return "/usr/games/menu_resources/"; }
-};
+  switch (type)
+  {
+#ifdef HAS_MENU_VOLUME
+  case MENU_TYPE_VOLUME: return true;
+#endif
+#ifdef HAS_MENU_BRIGHTNESS
+  case MENU_TYPE_BRIGHTNESS: return true;
+#endif
+#ifdef HAS_MENU_SAVE
+  case MENU_TYPE_SAVE: return true;
+#endif
+#ifdef HAS_MENU_LOAD
+  case MENU_TYPE_LOAD: return true;
+#endif
+#ifdef HAS_MENU_ASPECT_RATIO
+  case MENU_TYPE_ASPECT_RATIO: return true;
+#endif
+#ifdef HAS_MENU_USB
+  case MENU_TYPE_USB: return true;
+#endif
+#ifdef HAS_MENU_THEME
+  case MENU_TYPE_THEME: return true;
+#endif
+#ifdef HAS_MENU_LAUNCHER
+  case MENU_TYPE_LAUNCHER: return true;
+#endif
+#ifdef HAS_MENU_EXIT
+  case MENU_TYPE_EXIT: return true;
+#endif
+#ifdef HAS_MENU_POWERDOWN
+  case MENU_TYPE_POWERDOWN: return true;
+#endif
+#ifdef HAS_MENU_RO_RW
+  case MENU_TYPE_RO_RW: return true;
 #endif
+  default: return false;
+  }
+}
 
+/* built-in zones in the order they are shown, disabled ones are skipped so that the default list fits any build */
+static constexpr ENUM_MENU_TYPE menu_zone_list[] = { FK_MENU_ZONE_LIST };
 
-class FunKeyMenuEntry
+static constexpr size_t menu_builtin_zones()
 {
-  std::string caption;
-  std::function<void()> lambda;
-};
+  size_t count = 0;
+  for (size_t i = 0; i < sizeof(menu_zone_list) / sizeof(menu_zone_list[0]); i++)
+  {
+    for (size_t j = 0; j < i; j++)
+    {
+      if (menu_zone_list[j] == menu_zone_list[i])
+        return 0;
+    }
+    count += menu_zone_enabled(menu_zone_list[i]) ? 1 : 0;
+  }
+  return count;
+}
 
-class FunKeyMenu
+static constexpr size_t MENU_BUILTIN_ZONES = menu_builtin_zones();
+static_assert(MENU_BUILTIN_ZONES > 0, "FK_MENU_ZONE_LIST must list enabled zones once each");
+
+#define GRAY_MAIN_R                 85
+#define GRAY_MAIN_G                 85
+#define GRAY_MAIN_B                 85
+#define WHITE_MAIN_R                236
+#define WHITE_MAIN_G                236
+#define WHITE_MAIN_B                236
+
+#define MAX_SAVE_SLOTS              9
+
+#define MAXPATHLEN                  512
+
+/// -------------- PROFILING --------------
+
+#ifdef MENU_PROFILE
+/* process wide counters fed by scoped timers from any thread, durations are kept in a log-linear
+   histogram (4 buckets per power of two) so that percentiles cost no allocation */
+class MenuProfiler
 {
 private:
-  bool wasTTFInit;
-  std::vector<FunKeyMenuEntry> entry;
+  static constexpr int SUB_BUCKETS = 4;
+  static constexpr int NB_BUCKETS = 31 * SUB_BUCKETS;
 
-  static constexpr int MENU_ZONE_WIDTH = 240;
-  static constexpr int MENU_ZONE_HEIGHT = 240;
-  
-  static constexpr int PADDING_Y = 18;
+  struct Counter
+  {
+    std::atomic<uint32_t> count;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint32_t> max;
+    std::array<std::atomic<uint32_t>, NB_BUCKETS> buckets;
+  };
 
-public:
-  SDL_Surface* screen;
-  TTF_Font* fontTitle, *fontInfo, *fontSmallInfo;
-  SDL_Surface* upArrow, *downArrow;
+  static Counter counters[NB_MENU_STATS];
 
-  FunKeyMenu(SDL_Surface* screen) : screen(screen), wasTTFInit(false)
+  static int bucket(uint32_t us)
   {
+    if (us < SUB_BUCKETS)
+      return us;
 
+    int msb = 0;
+    while (us >> (msb + 1))
+      msb++;
+    return (msb - 1) * SUB_BUCKETS + ((us >> (msb - 2)) & (SUB_BUCKETS - 1));
   }
 
-  void setScreen(SDL_Surface* screen) { this->screen = screen; }
+  static uint32_t bucketUpperBound(int index)
+  {
+    if (index < SUB_BUCKETS)
+      return index;
+
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    return (uint32_t)MIN(lower + (1ull << shift) - 1, 0xFFFFFFFFull);
+  }
 
-  SDL_Surface* loadImageResource(const path_t& path)
+public:
+  static void record(int stat, uint32_t us, uint64_t bytes)
   {
-    SDL_Surface* dest = IMG_Load((Platform::resourcePath() + path).c_str());
-    if (!dest)
-      MENU_ERROR_PRINTF("ERROR IMG_Load: %s\n", IMG_GetError());
-    return dest;
+    Counter& counter = counters[stat];
+    counter.count++;
+    counter.total += us;
+    counter.bytes += bytes;
+    counter.buckets[bucket(us)]++;
+
+    uint32_t max = counter.max;
+    while (us > max && !counter.max.compare_exchange_weak(max, us));
   }
 
-  TTF_Font* loadFontResource(const path_t& path, int size)
+  static void get(int stat, FK_MenuStat& stat_out)
   {
-    TTF_Font* dest = TTF_OpenFont((Platform::resourcePath() + path).c_str(), size);
-    if (!dest)
-      MENU_ERROR_PRINTF("ERROR in init_menu_SDL: Could not open menu font %s, %s\n", path.c_str(), SDL_GetError());
-    return dest;
+    const Counter& counter = counters[stat];
+    stat_out.count = counter.count;
+    stat_out.total_us = counter.total;
+    stat_out.bytes = counter.bytes;
+    stat_out.max_us = counter.max;
+    stat_out.p99_us = 0;
+
+    /// ------ First bucket reaching 99% of the samples ------
+    uint64_t threshold = ((uint64_t)stat_out.count * 99 + 99) / 100, seen = 0;
+    for (int i = 0; i < NB_BUCKETS && stat_out.count; i++)
+    {
+      seen += counter.buckets[i];
+      if (seen >= threshold)
+      {
+        stat_out.p99_us = MIN(bucketUpperBound(i), stat_out.max_us);
+        break;
+      }
+    }
   }
 
-  void initTTF()
+  static void reset()
   {
-    wasTTFInit = TTF_WasInit();
-    if (!wasTTFInit)
-      TTF_Init();
+    for (Counter& counter : counters)
+    {
+      counter.count = 0;
+      counter.total = 0;
+      counter.bytes = 0;
+      counter.max = 0;
+      for (auto& bucket : counter.buckets)
+        bucket = 0;
+    }
   }
 
-  void deinitTTF()
+  static void dump()
   {
-    if (!wasTTFInit)
-      TTF_Quit();
+    static const char* const names[NB_MENU_STATS] = { "init", "preload", "system values", "open", "refresh", "blit", "text", "shell" };
+
+    printf("Menu stats:       count     total us    max us    p99 us        bytes\n");
+    for (int i = 0; i < NB_MENU_STATS; i++)
+    {
+      FK_MenuStat stat;
+      get(i, stat);
+      printf("  %-14s %7u %12llu %9u %9u %12llu\n", names[i], stat.count, (unsigned long long)stat.total_us,
+        stat.max_us, stat.p99_us, (unsigned long long)stat.bytes);
+    }
   }
+};
 
-  void loadResources()
+MenuProfiler::Counter MenuProfiler::counters[NB_MENU_STATS];
+
+/* records the time elapsed from its creation to its destruction, or to stop() */
+class ScopedTimer
+{
+private:
+  int stat;
+  bool running;
+  uint64_t bytes;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  ScopedTimer(int stat) : stat(stat), running(true), bytes(0), start(std::chrono::steady_clock::now()) { }
+  ~ScopedTimer() { stop(); }
+
+  /* amount of data processed while timing, reported along with the duration */
+  void addBytes(uint64_t bytes) { this->bytes += bytes; }
+
+  void stop()
   {
-    upArrow = loadImageResource("arrow_top.png");
-    downArrow = loadImageResource("arrow_bottom.png");
+    if (!running)
+      return;
 
-    fontTitle = loadFontResource("OpenSans-Bold.ttf", 22);
-    fontInfo = loadFontResource("OpenSans-Bold.ttf", 16);
-    fontSmallInfo = loadFontResource("OpenSans-Semibold.ttf", 13);
+    running = false;
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    MenuProfiler::record(stat, (uint32_t)MIN(elapsed.count(), (decltype(elapsed.count()))0xFFFFFFFF), bytes);
   }
+};
 
-  void releaseResources()
+#define MENU_PROFILE_CONCAT_(a, b)        a##b
+#define MENU_PROFILE_CONCAT(a, b)         MENU_PROFILE_CONCAT_(a, b)
+#define MENU_PROFILE_SCOPE(stat)          ScopedTimer MENU_PROFILE_CONCAT(profile_timer_, __LINE__)(stat)
+#define MENU_PROFILE_BEGIN(timer, stat)   ScopedTimer timer(stat)
+#define MENU_PROFILE_END(timer)           timer.stop()
+#else
+#define MENU_PROFILE_SCOPE(stat)
+#define MENU_PROFILE_BEGIN(timer, stat)
+#define MENU_PROFILE_END(timer)
+#endif //MENU_PROFILE
+
+
+class SystemControl;
+
+#if defined(_WIN32)
+struct Platform
+{
+  static SystemControl& systemControl();
+  static FILE* platformPopen(const char* command, const char* type) { return nullptr; }
+  static int platformPclose(FILE* fp) { return -1; }
+  static path_t resourcePath() { return ""; }
+
+  /* no mmap here, the file is read at once instead */
+  static void* mapFile(const path_t& path, size_t& size)
   {
-    SDL_FreeSurface(upArrow);
-    SDL_FreeSurface(downArrow);
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+      return nullptr;
+
+    void* data = nullptr;
+    if (fseek(fp, 0, SEEK_END) == 0)
+    {
+      long length = ftell(fp);
+      if (length > 0 && fseek(fp, 0, SEEK_SET) == 0 && (data = malloc(length)) != nullptr)
+      {
+        if (fread(data, 1, length, fp) == (size_t)length)
+          size = length;
+        else
+        {
+          free(data);
+          data = nullptr;
+        }
+      }
+    }
 
-    TTF_CloseFont(fontTitle);
-    TTF_CloseFont(fontInfo);
-    TTF_CloseFont(fontSmallInfo);
+    fclose(fp);
+    return data;
   }
 
-  void blitCentered(SDL_Surface* surface, int yOffset, SDL_Surface* dest)
+  static void unmapFile(void* data, size_t size) { free(data); }
+
+  static int64_t modificationTime(const path_t& path)
   {
-    SDL_Rect point;
-    point.x = (dest->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - surface->w) / 2;
-    point.y = dest->h - MENU_ZONE_HEIGHT / 2 - surface->h / 2 + PADDING_Y * yOffset;
-    SDL_BlitSurface(surface, NULL, dest, &point);
+    struct _stat st;
+    return _stat(path.c_str(), &st) == 0 ? (int64_t)st.st_mtime : 0;
   }
 
-  void printCentered(TTF_Font* font, const std::string& text, SDL_Color color, int yOffset, SDL_Surface* dest)
+  static bool syncFile(FILE* fp) { return fflush(fp) == 0; }
+
+  /* rename does not overwrite here */
+  static bool replaceFile(const path_t& from, const path_t& to)
   {
-    SDL_Surface* surface = TTF_RenderText_Blended(font, text.c_str(), color);
-    blitCentered(surface, yOffset, dest);
-    SDL_FreeSurface(surface);
+    remove(to.c_str());
+    return rename(from.c_str(), to.c_str()) == 0;
   }
-};
 
-void FK_InitMenu(fkmenu_t& handle, SDL_Surface* screen)
+#ifdef HAS_MENU_RO_RW
+  static int mountState(const char* mountPoint) { return -1; }
+#endif
+};
+#else
+struct Platform
 {
-  FunKeyMenu* menu = new FunKeyMenu(screen);
-  handle = reinterpret_cast<uintptr_t>(menu);
-}
+  static SystemControl& systemControl();
+  static FILE* platformPopen(const char* command, const char* type) { return popen(command, type); }
+  static int platformPclose(FILE* fp) { return pclose(fp); }
+  static path_t resourcePath() { return "/usr/games/menu_resources/"; }
 
-void FK_StopMenu(fkmenu_t& handle)
-{
-  FunKeyMenu* menu = reinterpret_cast<FunKeyMenu*>(handle);
-  delete menu;
-}
+  /* private writable mapping, pages are only read from the file when touched and never written back */
+  static void* mapFile(const path_t& path, size_t& size)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return nullptr;
+
+    void* data = nullptr;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+      data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+        data = nullptr;
+      else
+        size = st.st_size;
+    }
 
-//TODO: stub to integrate with existing code during migration
-FunKeyMenu menu = FunKeyMenu(nullptr);
+    close(fd);
+    return data;
+  }
 
- /// -------------- DEFINES --------------
+  static void unmapFile(void* data, size_t size) { munmap(data, size); }
 
-#define MIN(a,b) (((a)<(b))?(a):(b))
-#define MAX(a,b) (((a)>(b))?(a):(b))
+  static int64_t modificationTime(const path_t& path)
+  {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (int64_t)st.st_mtime : 0;
+  }
 
-#define SCREEN_HORIZONTAL_SIZE      240 //RES_HW_SCREEN_HORIZONTAL
-#define SCREEN_VERTICAL_SIZE        240 //RES_HW_SCREEN_VERTICAL
+  /* the console is often powered off right after a save, data must reach the card before the file is renamed */
+  static bool syncFile(FILE* fp) { return fflush(fp) == 0 && fsync(fileno(fp)) == 0; }
 
-#define SCROLL_SPEED_PX             30
-#define FPS_MENU                    60
-#define ARROWS_PADDING              8
+  static bool replaceFile(const path_t& from, const path_t& to) { return rename(from.c_str(), to.c_str()) == 0; }
 
-#define MENU_ZONE_WIDTH             SCREEN_HORIZONTAL_SIZE
-#define MENU_ZONE_HEIGHT            SCREEN_VERTICAL_SIZE
-#define MENU_BG_SQURE_WIDTH         180
-#define MENU_BG_SQUREE_HEIGHT       140
+#ifdef HAS_MENU_RO_RW
+  /* 1 if mountPoint is mounted read-write, 0 if read-only, -1 if unknown. The last entry wins, as it hides the others */
+  static int mountState(const char* mountPoint)
+  {
+    FILE* fp = fopen(PROC_MOUNTS_PATH, "r");
+    if (!fp)
+      return -1;
+
+    int state = -1;
+    char line[512], dir[256], options[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+      if (sscanf(line, "%*s %255s %*s %255s", dir, options) == 2 && !strcmp(dir, mountPoint))
+        state = (!strncmp(options, "rw", 2) && (options[2] == ',' || !options[2])) ? 1 : 0;
+    }
 
-#define GRAY_MAIN_R                 85
-#define GRAY_MAIN_G                 85
-#define GRAY_MAIN_B                 85
-#define WHITE_MAIN_R                236
-#define WHITE_MAIN_G                236
-#define WHITE_MAIN_B                236
+    fclose(fp);
+    return state;
+  }
+#endif
+};
+#endif
 
-#define MAX_SAVE_SLOTS              9
 
-#define MAXPATHLEN                  512
+/* runs shell commands on a background thread so that the menu loop never blocks on a fork */
+class CommandWorker
+{
+public:
+  using ticket_t = uint32_t;
+  using job_t = std::function<int()>;
 
+private:
+  struct Job
+  {
+    std::string key;
+    job_t job;
+    std::vector<ticket_t> tickets;
+  };
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::deque<Job> queue;
+  std::unordered_map<ticket_t, int> results;
+  std::function<void()> notifier;
+  ticket_t nextTicket;
+  bool busy;
+  bool running;
+
+  void loop()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
 
-/// -------------- STATIC VARIABLES --------------
-static SDL_Surface* background_screen = NULL;
-static int backup_key_repeat_delay = 0;
-static int backup_key_repeat_interval = 0;
-static SDL_Surface** menu_zone_surfaces = NULL;
-static int* idx_menus = NULL;
-static int nb_menu_zones = 0;
-static int menuItem = 0;
-static int stop_menu_loop = 0;
+    while (true)
+    {
+      cond.wait(lock, [this] { return !queue.empty() || !running; });
 
-static SDL_Color text_color = { GRAY_MAIN_R, GRAY_MAIN_G, GRAY_MAIN_B };
-static int padding_y_from_center_menu_zone = 18;
-static uint16_t width_progress_bar = 100;
-static uint16_t height_progress_bar = 20;
+      if (queue.empty())
+        break;
 
-#ifdef HAS_MENU_VOLUME
-static uint16_t x_volume_bar = 0;
-static uint16_t y_volume_bar = 0;
-static int volume_percentage = 0;
-#endif
-#ifdef HAS_MENU_BRIGHTNESS
-static uint16_t x_brightness_bar = 0;
-static uint16_t y_brightness_bar = 0;
-static int brightness_percentage = 0;
-#endif
+      Job current = std::move(queue.front());
+      queue.pop_front();
+      busy = true;
 
-#ifdef HAS_MENU_ASPECT_RATIO
-#undef X
-#define X(a, b) b,
-static const char* aspect_ratio_name[] = { ASPECT_RATIOS };
-static int aspect_ratio = ASPECT_RATIOS_TYPE_STRECHED;
-static int aspect_ratio_factor_percent = 50;
-static int aspect_ratio_factor_step = 10;
-#endif
+      lock.unlock();
+      int status = current.job();
+      lock.lock();
 
-#ifdef HAS_MENU_THEME
-static Configuration* config = NULL;
-static int indexChooseLayout = 0;
-#endif
+      busy = false;
+      for (ticket_t ticket : current.tickets)
+        results[ticket] = status;
+      cond.notify_all();
 
-#if defined(HAS_MENU_SAVE) || defined (HAS_MENU_LOAD)
-static int savestate_slot = 0;
-#endif
+      if (notifier)
+      {
+        lock.unlock();
+        notifier();
+        lock.lock();
+      }
+    }
+  }
 
-#ifdef HAS_MENU_USB
-/// USB stuff
-static int usb_data_connected = 0;
-static int usb_sharing = 0;
-#endif
+public:
+  CommandWorker() : nextTicket(1), busy(false), running(false) { }
+  ~CommandWorker() { stop(); }
 
-#ifdef HAS_MENU_RO_RW
-static int read_write = 0;
-#endif
+  /* runs a command to completion and reaps it, returns < 0 on failure like system() */
+  static int runShell(const std::string& command)
+  {
+    MENU_PROFILE_SCOPE(MENU_STAT_SHELL);
 
-/// -------------- FUNCTIONS IMPLEMENTATION --------------
+    FILE* fp = Platform::platformPopen(command.c_str(), "r");
+    if (fp == NULL) {
+      MENU_ERROR_PRINTF("Failed to run command %s\n", command.c_str());
+      return -1;
+    }
 
-#if defined(HAS_MENU_VOLUME) || defined(HAS_MENU_BRIGHTNESS)
-static void draw_progress_bar(SDL_Surface* surface, uint16_t x, uint16_t y, uint16_t width,
-  uint16_t height, uint8_t percentage, uint16_t nb_bars)
-{
-  /// ------ Init Variables ------
-  uint16_t line_width = 1; //px
-  uint16_t padding_bars_ratio = 3;
-  uint16_t nb_full_bars = 0;
+    char res[100];
+    while (fgets(res, sizeof(res), fp) != NULL);
 
-  /// ------ Check values ------
-  percentage = (percentage > 100) ? 100 : percentage;
-  x = (x > (surface->w - 1)) ? (surface->w - 1) : x;
-  y = (y > surface->h - 1) ? (surface->h - 1) : y;
-  width = (width < line_width * 2 + 1) ? (line_width * 2 + 1) : width;
-  width = (width > surface->w - x - 1) ? (surface->w - x - 1) : width;
-  height = (height < line_width * 2 + 1) ? (line_width * 2 + 1) : height;
-  height = (height > surface->h - y - 1) ? (surface->h - y - 1) : height;
-  uint16_t nb_bars_max = (width * padding_bars_ratio / (line_width * 2 + 1) + 1) / (padding_bars_ratio + 1);
-  nb_bars = (nb_bars > nb_bars_max) ? nb_bars_max : nb_bars;
-  uint16_t bar_width = (width / nb_bars) * padding_bars_ratio / (padding_bars_ratio + 1) + 1;
-  uint16_t bar_padding_x = bar_width / padding_bars_ratio;
-  nb_full_bars = nb_bars * percentage / 100;
+    return Platform::platformPclose(fp);
+  }
 
-  /// ------ draw full bars ------
-  for (int i = 0; i < nb_full_bars; ++i)
+  /* called from the worker thread each time a job completes */
+  void setNotifier(std::function<void()> notifier)
   {
-    /// ---- draw one bar ----
-    //MENU_DEBUG_PRINTF("Drawing filled bar %d\n", i);
-    SDL_Rect rect = { x + i * (bar_width + bar_padding_x),
-        y, bar_width, height };
-    SDL_FillRect(surface, &rect, SDL_MapRGB(surface->format, GRAY_MAIN_R, GRAY_MAIN_G, GRAY_MAIN_B));
+    std::lock_guard<std::mutex> lock(mutex);
+    this->notifier = notifier;
   }
 
-  /// ------ draw full bars ------
-  for (int i = 0; i < (nb_bars - nb_full_bars); ++i)
+  /* enqueues a job, a still pending job with the same key is replaced so that only the latest value is applied */
+  ticket_t post(const std::string& key, job_t job)
   {
-    /// ---- draw one bar ----
-    //MENU_DEBUG_PRINTF("Drawing empty bar %d\n", i);
-    SDL_Rect rect = { x + i * (bar_width + bar_padding_x) + nb_full_bars * (bar_width + bar_padding_x),
-        y, bar_width, height };
-    SDL_FillRect(surface, &rect, SDL_MapRGB(surface->format, GRAY_MAIN_R, GRAY_MAIN_G, GRAY_MAIN_B));
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!running)
+    {
+      running = true;
+      thread = std::thread(&CommandWorker::loop, this);
+    }
+
+    ticket_t ticket = nextTicket++;
+
+    for (Job& pending : queue)
+    {
+      if (!key.empty() && pending.key == key)
+      {
+        pending.job = std::move(job);
+        pending.tickets.push_back(ticket);
+        return ticket;
+      }
+    }
 
-    SDL_Rect rect2 = { x + i * (bar_width + bar_padding_x) + line_width + nb_full_bars * (bar_width + bar_padding_x),
-        y + line_width, bar_width - line_width * 2, height - line_width * 2 };
-    SDL_FillRect(surface, &rect2, SDL_MapRGB(surface->format, WHITE_MAIN_R, WHITE_MAIN_R, WHITE_MAIN_R));
+    queue.push_back({ key, std::move(job), { ticket } });
+    cond.notify_all();
+    return ticket;
   }
 
+  ticket_t postShell(const std::string& key, const std::string& command)
+  {
+    return post(key, [command] { return runShell(command); });
+  }
 
-}
-#endif
+  /* returns true and the exit status once the job behind ticket has completed */
+  bool result(ticket_t ticket, int& status)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
 
-static void add_menu_zone(ENUM_MENU_TYPE menu_type)
-{
-  /// ------ Increase nb of menu zones -------
-  nb_menu_zones++;
+    auto it = results.find(ticket);
+    if (it == results.end())
+      return false;
 
-  /// ------ Realoc idx Menus array -------
-  if (!idx_menus) {
-    idx_menus = (int*)malloc(nb_menu_zones * sizeof(int));
-    menu_zone_surfaces = (SDL_Surface**)malloc(nb_menu_zones * sizeof(SDL_Surface*));
+    status = it->second;
+    results.erase(it);
+    return true;
   }
-  else {
-    int* temp = (int*)realloc(idx_menus, nb_menu_zones * sizeof(int));
-    idx_menus = temp;
-    menu_zone_surfaces = (SDL_Surface**)realloc(menu_zone_surfaces, nb_menu_zones * sizeof(SDL_Surface*));
+
+  /* blocks until the job behind ticket has completed and returns its exit status */
+  int wait(ticket_t ticket)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this, ticket] { return results.find(ticket) != results.end(); });
+
+    int status = results[ticket];
+    results.erase(ticket);
+    return status;
   }
-  idx_menus[nb_menu_zones - 1] = menu_type;
 
-  /// ------ Reinit menu surface with height increased -------
-  menu_zone_surfaces[nb_menu_zones - 1] = menu.loadImageResource("zone_bg.png");
+  /* blocks until every queued job has been run */
+  void flush()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return queue.empty() && !busy; });
+  }
 
-  /// --------- Init Common Variables --------
-  SDL_Surface* text_surface = NULL;
-  SDL_Surface* surface = menu_zone_surfaces[nb_menu_zones - 1];
-  SDL_Rect text_pos;
+  /* runs the remaining jobs and joins the worker thread */
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running = false;
+      cond.notify_all();
+    }
 
-  /// --------- Add new zone ---------
-  switch (menu_type) {
-#ifdef HAS_MENU_VOLUME
-  case MENU_TYPE_VOLUME:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_VOLUME\n");
-    /// ------ Text ------
-    menu.printCentered(menu.fontTitle, "VOLUME", text_color, -1, surface);
-
-    x_volume_bar = (surface->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - width_progress_bar) / 2;
-    y_volume_bar = surface->h - MENU_ZONE_HEIGHT / 2 - height_progress_bar / 2 + padding_y_from_center_menu_zone;
-    draw_progress_bar(surface, x_volume_bar, y_volume_bar,
-      width_progress_bar, height_progress_bar, 0, 100 / STEP_CHANGE_VOLUME);
-    break;
-#endif
-#ifdef HAS_MENU_BRIGHTNESS
-  case MENU_TYPE_BRIGHTNESS:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_BRIGHTNESS\n");
-    /// ------ Text ------
-    menu.printCentered(menu.fontTitle, "BRIGHTNESS", text_color, -1, surface);
-
-    x_brightness_bar = (surface->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - width_progress_bar) / 2;
-    y_brightness_bar = surface->h - MENU_ZONE_HEIGHT / 2 - height_progress_bar / 2 + padding_y_from_center_menu_zone;
-    draw_progress_bar(surface, x_brightness_bar, y_brightness_bar,
-      width_progress_bar, height_progress_bar, 0, 100 / STEP_CHANGE_BRIGHTNESS);
-    break;
-#endif
-#ifdef HAS_MENU_SAVE
-  case MENU_TYPE_SAVE:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_SAVE\n");
-    menu.printCentered(menu.fontTitle, "SAVE", text_color, -2, surface);
-    break;
-#endif
-#ifdef HAS_MENU_LOAD
-  case MENU_TYPE_LOAD:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_LOAD\n");
-    menu.printCentered(menu.fontTitle, "LOAD", text_color, -2, surface);
+    if (thread.joinable())
+      thread.join();
 
-    break;
-#endif
-#ifdef HAS_MENU_ASPECT_RATIO
-  case MENU_TYPE_ASPECT_RATIO:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_ASPECT_RATIO\n");
-    menu.printCentered(menu.fontTitle, "ASPECT RATIO", text_color, -1, surface);
-    break;
-#endif
+    results.clear();
+  }
+};
+
+/* system values shown by the menu, as read at once */
+struct SystemSnapshot
+{
+  int volume;
+  int brightness;
+  bool hasVolume;
+  bool hasBrightness;
 #ifdef HAS_MENU_USB
-  case MENU_TYPE_USB:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_USB\n");
-    /// ------ Text ------
-    text_surface = TTF_RenderText_Blended(menu.fontTitle, "USB", text_color);
-    text_pos.x = (surface->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-    text_pos.y = surface->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2;
-    SDL_BlitSurface(text_surface, NULL, surface, &text_pos);
-    break;
-#endif
-#ifdef HAS_MENU_THEME
-  case MENU_TYPE_THEME:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_THEME\n");
-    /// ------ Text ------
-    text_surface = TTF_RenderText_Blended(menu.fontTitle, "SET THEME", text_color);
-    text_pos.x = (surface->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-    text_pos.y = surface->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 - padding_y_from_center_menu_zone * 2;
-    SDL_BlitSurface(text_surface, NULL, surface, &text_pos);
-    break;
+  int usbDataConnected;
+  int usbSharing;
 #endif
-#ifdef HAS_MENU_LAUNCHER
-  case MENU_TYPE_LAUNCHER:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_LAUNCHER\n");
-    /// ------ Text ------
-    text_surface = TTF_RenderText_Blended(menu.fontTitle, "SET LAUNCHER", text_color);
-    text_pos.x = (surface->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-    text_pos.y = surface->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 - padding_y_from_center_menu_zone * 2;
-    SDL_BlitSurface(text_surface, NULL, surface, &text_pos);
-    /// ------ Text ------
-    text_surface = TTF_RenderText_Blended(menu.fontTitle, "GMENU2X", text_color);
-    text_pos.x = (surface->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-    text_pos.y = surface->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2;
-    SDL_BlitSurface(text_surface, NULL, surface, &text_pos);
-    break;
-#endif
-#ifdef HAS_MENU_RO_RW
-  case MENU_TYPE_RO_RW:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_RO_RW\n");
-    text_surface = TTF_RenderText_Blended(menu.fontTitle, "SET SYSTEM:", text_color);
-    text_pos.x = (surface->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-    text_pos.y = surface->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 - padding_y_from_center_menu_zone * 2;
-    SDL_BlitSurface(text_surface, NULL, surface, &text_pos);
-    break;
-#endif
-#ifdef HAS_MENU_EXIT
-  case MENU_TYPE_EXIT:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_EXIT\n");
-    menu.printCentered(menu.fontTitle, "EXIT APP", text_color, 0, surface);
+};
 
-    break;
-#endif
-#ifdef HAS_MENU_POWERDOWN
-  case MENU_TYPE_POWERDOWN:
-    MENU_DEBUG_PRINTF("Init MENU_TYPE_POWERDOWN\n");
-    menu.printCentered(menu.fontTitle, "POWERDOWN", text_color, 0, surface);
-    break;
-#endif
-  default:
-    MENU_DEBUG_PRINTF("Warning - In add_menu_zone, unknown MENU_TYPE: %d\n", menu_type);
-    break;
+/* backend used by the menu to get and set system values */
+class SystemControl
+{
+public:
+  virtual ~SystemControl() { }
+
+  virtual bool getVolume(int& percentage) = 0;
+  virtual bool setVolume(int percentage) = 0;
+  virtual bool getBrightness(int& percentage) = 0;
+  virtual bool setBrightness(int percentage) = 0;
+
+  /* reads every value, backends which can batch their queries override it */
+  virtual void getAll(SystemSnapshot& snapshot)
+  {
+    snapshot.hasVolume = getVolume(snapshot.volume);
+    snapshot.hasBrightness = getBrightness(snapshot.brightness);
   }
 
-  /// ------ Free Surfaces -------
-  SDL_FreeSurface(text_surface);
-}
+  /* makes values survive a reboot, called once when leaving the menu */
+  virtual bool persistVolume(int /*percentage*/) { return true; }
+  virtual bool persistBrightness(int /*percentage*/) { return true; }
+};
 
-static void init_menu_zones(void)
+/* original backend, forks the FunKey helper scripts */
+class ShellSystemControl : public SystemControl
 {
+private:
+  /* reads one value per output line, returns how many were read before the first wrong one */
+  int query(const char* command, int* values, int count)
+  {
+    MENU_PROFILE_SCOPE(MENU_STAT_SHELL);
+    char res[100];
+
+    FILE* fp = Platform::platformPopen(command, "r");
+    if (fp == NULL) {
+      MENU_ERROR_PRINTF("Failed to run command %s\n", command);
+      return 0;
+    }
+
+    int read = 0;
+    bool valid = true;
+    while (fgets(res, sizeof(res) - 1, fp) != NULL) {
+      /// Check if value is a number (at least the first char)
+      if (valid && read < count && res[0] >= '0' && res[0] <= '9')
+        values[read++] = atoi(res);
+      else if (valid && read < count) {
+        MENU_ERROR_PRINTF("Wrong return value: %s for cmd: %s\n", res, command);
+        valid = false;
+      }
+    }
+    Platform::platformPclose(fp);
+
+    if (!read && valid)
+      MENU_ERROR_PRINTF("No return value for cmd: %s\n", command);
+    return read;
+  }
+
+  bool query(const char* command, int& value) { return query(command, &value, 1) == 1; }
+
+  bool apply(const char* command, int value)
+  {
+    char shell_cmd[100];
+    sprintf(shell_cmd, "%s %d", command, value);
+    return CommandWorker::runShell(shell_cmd) >= 0;
+  }
+
+public:
 #ifdef HAS_MENU_VOLUME
-  add_menu_zone(MENU_TYPE_VOLUME);
+  bool getVolume(int& percentage) override { return query(SHELL_CMD_VOLUME_GET, percentage); }
+  bool setVolume(int percentage) override { return apply(SHELL_CMD_VOLUME_SET, percentage); }
+#else
+  bool getVolume(int& percentage) override { return false; }
+  bool setVolume(int percentage) override { return false; }
 #endif
 #ifdef HAS_MENU_BRIGHTNESS
-  add_menu_zone(MENU_TYPE_BRIGHTNESS);
-#endif
-#ifdef HAS_MENU_SAVE
-  add_menu_zone(MENU_TYPE_SAVE);
-#endif
-#ifdef HAS_MENU_LOAD
-  add_menu_zone(MENU_TYPE_LOAD);
-#endif
-#ifdef HAS_MENU_ASPECT_RATIO
-  add_menu_zone(MENU_TYPE_ASPECT_RATIO);
-#endif
-#ifdef HAS_MENU_RO_RW
-  add_menu_zone(MENU_TYPE_RO_RW);
-#endif
-#ifdef HAS_MENU_EXIT
-  add_menu_zone(MENU_TYPE_EXIT);
-#endif
-#ifdef HAS_MENU_USB
-  add_menu_zone(MENU_TYPE_USB);
-#endif
-#ifdef HAS_MENU_THEME
-  add_menu_zone(MENU_TYPE_THEME);
-#endif
-#ifdef HAS_MENU_LAUNCHER
-  add_menu_zone(MENU_TYPE_LAUNCHER);
-#endif
-#ifdef HAS_MENU_POWERDOWN
-  add_menu_zone(MENU_TYPE_POWERDOWN);
+  bool getBrightness(int& percentage) override { return query(SHELL_CMD_BRIGHTNESS_GET, percentage); }
+  bool setBrightness(int percentage) override { return apply(SHELL_CMD_BRIGHTNESS_SET, percentage); }
+#else
+  bool getBrightness(int& percentage) override { return false; }
+  bool setBrightness(int percentage) override { return false; }
 #endif
-}
 
+#if defined(HAS_MENU_VOLUME) && defined(HAS_MENU_BRIGHTNESS)
+  /* both helpers run from a single shell, their outputs are tagged so that one failing leaves the other alone */
+  void getAll(SystemSnapshot& snapshot) override
+  {
+    MENU_PROFILE_SCOPE(MENU_STAT_SHELL);
+    static const char* const command = "echo v=$(" SHELL_CMD_VOLUME_GET "); echo b=$(" SHELL_CMD_BRIGHTNESS_GET ")";
+    char res[100];
 
-#ifdef HAS_MENU_THEME
-void FK_InitMenu(Configuration& c)
-#else
-void FK_InitMenu(void)
+    snapshot.hasVolume = snapshot.hasBrightness = false;
+    snapshot.volume = snapshot.brightness = 0;
+
+    FILE* fp = Platform::platformPopen(command, "r");
+    if (fp == NULL) {
+      MENU_ERROR_PRINTF("Failed to run command %s\n", command);
+      return;
+    }
+
+    while (fgets(res, sizeof(res) - 1, fp) != NULL) {
+      /// Tag, then a number (at least the first char)
+      if (res[1] != '=' || res[2] < '0' || res[2] > '9')
+        continue;
+      if (res[0] == 'v' && !snapshot.hasVolume) {
+        snapshot.volume = atoi(res + 2);
+        snapshot.hasVolume = true;
+      }
+      else if (res[0] == 'b' && !snapshot.hasBrightness) {
+        snapshot.brightness = atoi(res + 2);
+        snapshot.hasBrightness = true;
+      }
+    }
+    Platform::platformPclose(fp);
+
+    if (!snapshot.hasVolume)
+      MENU_ERROR_PRINTF("No return value for cmd: %s\n", SHELL_CMD_VOLUME_GET);
+    if (!snapshot.hasBrightness)
+      MENU_ERROR_PRINTF("No return value for cmd: %s\n", SHELL_CMD_BRIGHTNESS_GET);
+  }
 #endif
+};
+
+/* keeps values in memory only, for headless runs which must leave the host settings alone */
+class DetachedSystemControl : public SystemControl
 {
-  MENU_DEBUG_PRINTF("Init Menu\n");
+private:
+  int volume = 50;
+  int brightness = 50;
 
-  menu.initTTF();
-  menu.loadResources();
+public:
+  bool getVolume(int& percentage) override { percentage = volume; return true; }
+  bool setVolume(int percentage) override { volume = percentage; return true; }
+  bool getBrightness(int& percentage) override { percentage = brightness; return true; }
+  bool setBrightness(int percentage) override { brightness = percentage; return true; }
+};
 
-#ifdef HAS_MENU_THEME
-  /// ------ Save config pointer ------
-  config = &c;
-#endif
-#ifdef HAS_MENU_RO_RW
-  /// ----- Shell cmd ----
-  if (system(SHELL_CMD_RO) < 0) {
-    MENU_ERROR_PRINTF("Failed to run command %s\n", SHELL_CMD_RO);
+/* talks to the backlight sysfs node and the ALSA mixer directly, falls back to the shell backend */
+class DirectSystemControl : public SystemControl
+{
+private:
+  ShellSystemControl fallback;
+  std::mutex mutex;
+
+#ifdef HAS_ALSA_MIXER
+  snd_mixer_t* mixer;
+  snd_mixer_elem_t* mixerElement;
+  long minVolume, maxVolume;
+
+  bool openMixer()
+  {
+    if (mixerElement)
+      return true;
+
+    if (!mixer)
+    {
+      snd_mixer_selem_id_t* sid;
+      int err;
+
+      if ((err = snd_mixer_open(&mixer, 0)) < 0 ||
+        (err = snd_mixer_attach(mixer, ALSA_MIXER_CARD)) < 0 ||
+        (err = snd_mixer_selem_register(mixer, NULL, NULL)) < 0 ||
+        (err = snd_mixer_load(mixer)) < 0)
+      {
+        MENU_ERROR_PRINTF("ERROR opening ALSA mixer %s: %s\n", ALSA_MIXER_CARD, snd_strerror(err));
+        closeMixer();
+        return false;
+      }
+
+      snd_mixer_selem_id_alloca(&sid);
+      snd_mixer_selem_id_set_index(sid, 0);
+      snd_mixer_selem_id_set_name(sid, ALSA_MIXER_ELEMENT);
+      mixerElement = snd_mixer_find_selem(mixer, sid);
+
+      if (!mixerElement || snd_mixer_selem_get_playback_volume_range(mixerElement, &minVolume, &maxVolume) < 0 || maxVolume <= minVolume)
+      {
+        MENU_ERROR_PRINTF("ERROR ALSA mixer element %s not found\n", ALSA_MIXER_ELEMENT);
+        closeMixer();
+        return false;
+      }
+    }
+
+    return mixerElement != NULL;
+  }
+
+  void closeMixer()
+  {
+    if (mixer)
+      snd_mixer_close(mixer);
+    mixer = NULL;
+    mixerElement = NULL;
   }
 #endif
 
-  /// ------ Init menu zones ------
-  init_menu_zones();
+  static bool readSysfs(const path_t& path, int& value)
+  {
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp)
+      return false;
 
-  return;
-}
+    bool ok = fscanf(fp, "%d", &value) == 1;
+    fclose(fp);
+    return ok;
+  }
 
+  static bool writeSysfs(const path_t& path, int value)
+  {
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp)
+      return false;
 
-void FK_EndMenu(void)
-{
-  MENU_DEBUG_PRINTF("End Menu \n");
+    bool ok = fprintf(fp, "%d\n", value) > 0;
+    return fclose(fp) == 0 && ok;
+  }
 
-  menu.releaseResources();
-  menu.deinitTTF();
+public:
+#ifdef HAS_ALSA_MIXER
+  DirectSystemControl() : mixer(NULL), mixerElement(NULL), minVolume(0), maxVolume(0) { }
+  ~DirectSystemControl() { closeMixer(); }
+#endif
 
-  /// ------ Free Surfaces -------
-  for (int i = 0; i < nb_menu_zones; i++) {
-    if (menu_zone_surfaces[i] != NULL) {
-      SDL_FreeSurface(menu_zone_surfaces[i]);
+  bool getVolume(int& percentage) override
+  {
+#ifdef HAS_ALSA_MIXER
+    std::lock_guard<std::mutex> lock(mutex);
+    long value;
+
+    if (openMixer())
+    {
+      snd_mixer_handle_events(mixer);
+      if (snd_mixer_selem_get_playback_volume(mixerElement, SND_MIXER_SCHN_FRONT_LEFT, &value) >= 0)
+      {
+        percentage = (int)(((value - minVolume) * 100 + (maxVolume - minVolume) / 2) / (maxVolume - minVolume));
+        return true;
+      }
     }
+#endif
+    return fallback.getVolume(percentage);
   }
 
-  /// ------ Free Menu memory and reset vars -----
-  if (idx_menus) {
-    free(idx_menus);
+  bool setVolume(int percentage) override
+  {
+#ifdef HAS_ALSA_MIXER
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (openMixer() && snd_mixer_selem_set_playback_volume_all(mixerElement, minVolume + (maxVolume - minVolume) * percentage / 100) >= 0)
+      return true;
+#endif
+    return fallback.setVolume(percentage);
   }
-  idx_menus = NULL;
-  nb_menu_zones = 0;
 
-#ifdef HAS_MENU_RO_RW
-  /// ----- Shell cmd ----
-  if (system(SHELL_CMD_RO) < 0) {
-    MENU_ERROR_PRINTF("Failed to run command %s\n", SHELL_CMD_RO);
+  bool getBrightness(int& percentage) override
+  {
+    int value, max;
+
+    if (readSysfs(SYSFS_BACKLIGHT_PATH "brightness", value) && readSysfs(SYSFS_BACKLIGHT_PATH "max_brightness", max) && max > 0)
+    {
+      percentage = (value * 100 + max / 2) / max;
+      return true;
+    }
+
+    return fallback.getBrightness(percentage);
+  }
+
+  bool setBrightness(int percentage) override
+  {
+    int max;
+
+    if (readSysfs(SYSFS_BACKLIGHT_PATH "max_brightness", max) && max > 0 && writeSysfs(SYSFS_BACKLIGHT_PATH "brightness", (max * percentage + 50) / 100))
+      return true;
+
+    return fallback.setBrightness(percentage);
   }
+
+  /* the helper scripts also save the value in the environment, let them do it once */
+  bool persistVolume(int percentage) override { return fallback.setVolume(percentage); }
+  bool persistBrightness(int percentage) override { return fallback.setBrightness(percentage); }
+};
+
+SystemControl& Platform::systemControl()
+{
+  static DetachedSystemControl detached;
+#if defined(_WIN32)
+  static ShellSystemControl platform;
+#else
+  static DirectSystemControl platform;
 #endif
 
-  return;
+  /* the environment is only looked at once, by the first call */
+  static SystemControl& control = getenv(MENU_ENV_DETACHED_SYSTEM_CONTROL) ? static_cast<SystemControl&>(detached) : platform;
+  return control;
 }
 
-void FK_StopMenu(void)
+/* last system values read, so that opening the menu does not wait for them. Past the freshness window they are
+   still used but refreshed in the background meanwhile, which picks up changes made outside of the menu */
+class SystemState
 {
-  stop_menu_loop = 1;
-}
+private:
+  /* values set by the menu while a refresh reads them, which the refresh must not overwrite */
+  enum
+  {
+    WRITTEN_VOLUME = 1 << 0,
+    WRITTEN_BRIGHTNESS = 1 << 1,
+    WRITTEN_USB_SHARING = 1 << 2,
+  };
+
+  mutable std::mutex mutex;
+  SystemSnapshot snapshot;
+  bool valid;
+  Uint32 time;
+  Uint32 freshness;
+  unsigned written;
 
+public:
+  static constexpr Uint32 DEFAULT_FRESHNESS_MS = 10000;
 
-static void init_menu_system_values(void)
-{
-#if defined(HAS_MENU_VOLUME) || defined(HAS_MENU_BRIGHTNESS) || defined(HAS_MENU_USB) || defined(HAS_MENU_RO_RW)
-  FILE* fp;
-  char res[100];
-#endif
+  SystemState() : snapshot(), valid(false), time(0), freshness(DEFAULT_FRESHNESS_MS), written(0) { }
 
-#ifdef HAS_MENU_VOLUME
-  /// ------- Get system volume percentage --------
-  fp = Platform::platformPopen(SHELL_CMD_VOLUME_GET, "r");
-  if (fp == NULL) {
-    MENU_ERROR_PRINTF("Failed to run command %s\n", SHELL_CMD_VOLUME_GET);
-    volume_percentage = 50; ///wrong value: setting default to 50
+  /* <= 0 refreshes values each time the menu opens */
+  void setFreshness(int ms)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    freshness = ms > 0 ? (Uint32)ms : 0;
   }
-  else {
-    fgets(res, sizeof(res) - 1, fp);
 
-    /// Check if Volume is a number (at least the first char)
-    if (res[0] < '0' || res[0] > '9') {
-      MENU_ERROR_PRINTF("Wrong return value: %s for volume cmd: %s\n", res, SHELL_CMD_VOLUME_GET);
-      volume_percentage = 50; ///wrong value: setting default to 50
-    }
-    else {
-      volume_percentage = atoi(res);
-      MENU_DEBUG_PRINTF("System volume = %d%%\n", volume_percentage);
+  /* reads all values in one go, blocks so it is meant for the command worker */
+  void refresh()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      written = 0;
     }
-  }
+
+    SystemSnapshot fresh = SystemSnapshot();
+    Platform::systemControl().getAll(fresh);
+#ifdef HAS_MENU_USB
+    fresh.usbDataConnected = Utils::executeRawPath(SHELL_CMD_USB_DATA_CONNECTED);
+    fresh.usbSharing = Utils::executeRawPath(SHELL_CMD_USB_CHECK_IS_SHARING);
 #endif
-#ifdef HAS_MENU_BRIGHTNESS
-  /// ------- Get system brightness percentage -------
-  fp = Platform::platformPopen(SHELL_CMD_BRIGHTNESS_GET, "r");
-  if (fp == NULL) {
-    MENU_ERROR_PRINTF("Failed to run command %s\n", SHELL_CMD_BRIGHTNESS_GET);
-    brightness_percentage = 50; ///wrong value: setting default to 50
-  }
-  else {
-    fgets(res, sizeof(res) - 1, fp);
 
-    /// Check if brightness is a number (at least the first char)
-    if (res[0] < '0' || res[0] > '9') {
-      MENU_ERROR_PRINTF("Wrong return value: %s for volume cmd: %s\n", res, SHELL_CMD_BRIGHTNESS_GET);
-      brightness_percentage = 50; ///wrong value: setting default to 50
+    std::lock_guard<std::mutex> lock(mutex);
+    if (written & WRITTEN_VOLUME)
+    {
+      fresh.volume = snapshot.volume;
+      fresh.hasVolume = snapshot.hasVolume;
     }
-    else {
-      brightness_percentage = atoi(res);
-      MENU_DEBUG_PRINTF("System brightness = %d%%\n", brightness_percentage);
+    if (written & WRITTEN_BRIGHTNESS)
+    {
+      fresh.brightness = snapshot.brightness;
+      fresh.hasBrightness = snapshot.hasBrightness;
     }
-  }
-#endif
 #ifdef HAS_MENU_USB
-  /// ------- Get USB Value -------
-  usb_data_connected = Utils::executeRawPath(SHELL_CMD_USB_DATA_CONNECTED);
-  usb_sharing = Utils::executeRawPath(SHELL_CMD_USB_CHECK_IS_SHARING);
+    if (written & WRITTEN_USB_SHARING)
+      fresh.usbSharing = snapshot.usbSharing;
+#endif
+    snapshot = fresh;
+    valid = true;
+    time = SDL_GetTicks();
+  }
 
-  /** Sanity check if usb not connected */
-  if (!usb_data_connected) {
-    usb_sharing = 0;
+  /* returns false if values were never read, stale is set if they are older than the freshness window */
+  bool get(SystemSnapshot& values, bool& stale) const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    values = snapshot;
+    stale = !freshness || SDL_GetTicks() - time >= freshness;
+    return valid;
+  }
 
-    if (idx_menus[menuItem] == MENU_TYPE_USB) {
-      menuItem = 0;
-    }
+  /// ------ Values set by the menu itself need not be read back ------
+  void setVolume(int percentage)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    snapshot.volume = percentage;
+    snapshot.hasVolume = true;
+    written |= WRITTEN_VOLUME;
   }
 
-  /** Sanity check if currently in USB sharing (should not happen) */
-  if (usb_sharing) {
+  void setBrightness(int percentage)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    snapshot.brightness = percentage;
+    snapshot.hasBrightness = true;
+    written |= WRITTEN_BRIGHTNESS;
+  }
 
-    /// Force USB menu to launch
-    for (int cur_idx = 0; cur_idx < nb_menu_zones; cur_idx++) {
-      if (idx_menus[cur_idx] == MENU_TYPE_USB) {
-        menuItem = cur_idx;
-        printf("USB mounted, setting menu item to %d\n", menuItem);
-        break;
-      }
-    }
+#ifdef HAS_MENU_USB
+  void setUsbSharing(int sharing)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    snapshot.usbSharing = sharing;
+    written |= WRITTEN_USB_SHARING;
   }
 #endif
-}
+};
 
-static void menu_screen_refresh(SDL_Surface* screen, int menuItem, int prevItem, int scroll, uint8_t menu_confirmation, uint8_t menu_action)
+/* every menu blit and text rendering goes through these so that they can be profiled */
+static int blitSurface(SDL_Surface* src, SDL_Rect* srcrect, SDL_Surface* dst, SDL_Rect* dstrect)
 {
-  /// --------- Vars ---------
-#ifdef HAS_MENU_USB
-  int print_arrows = (scroll || usb_sharing) ? 0 : 1;
+#ifdef MENU_PROFILE
+  ScopedTimer timer(MENU_STAT_BLIT);
+
+  /* a NULL destination means the origin, SDL writes the clipped size back either way */
+  SDL_Rect origin = { 0, 0, 0, 0 };
+  SDL_Rect* area = dstrect ? dstrect : &origin;
+  int result = SDL_BlitSurface(src, srcrect, dst, area);
+  if (!result)
+    timer.addBytes((uint64_t)area->w * area->h * dst->format->BytesPerPixel);
+  return result;
 #else
-  int print_arrows = 1;
+  return SDL_BlitSurface(src, srcrect, dst, dstrect);
 #endif
+}
 
-  /// --------- Clear HW screen ----------
-  if (SDL_BlitSurface(background_screen, NULL, screen, NULL)) {
-    MENU_ERROR_PRINTF("ERROR Could not Clear screen: %s\n", SDL_GetError());
+static SDL_Surface* renderText(TTF_Font* font, const char* text, SDL_Color color)
+{
+  MENU_PROFILE_SCOPE(MENU_STAT_TEXT);
+  return TTF_RenderText_Blended(font, text, color);
+}
+
+/* replaces surface with a copy in the display pixel format so that blitting it needs no per-pixel conversion,
+   surfaces with an alpha channel keep it and can be RLE accelerated if they won't be drawn onto anymore */
+static SDL_Surface* toDisplayFormat(SDL_Surface* surface, bool rle)
+{
+  if (!surface || !SDL_GetVideoSurface())
+    return surface;
+
+  bool hasAlpha = surface->format->Amask != 0;
+  SDL_Surface* converted = hasAlpha ? SDL_DisplayFormatAlpha(surface) : SDL_DisplayFormat(surface);
+  if (!converted)
+  {
+    MENU_ERROR_PRINTF("ERROR Could not convert surface to display format: %s\n", SDL_GetError());
+    return surface;
   }
 
-  /// --------- Setup Blit Window ----------
-  SDL_Rect menu_blit_window;
-  menu_blit_window.x = 0;
-  menu_blit_window.w = SCREEN_HORIZONTAL_SIZE;
+  if (hasAlpha && rle)
+    SDL_SetAlpha(converted, SDL_SRCALPHA | SDL_RLEACCEL, SDL_ALPHA_OPAQUE);
 
-  /// --------- Blit prev menu Zone going away ----------
-  menu_blit_window.y = scroll;
-  menu_blit_window.h = SCREEN_VERTICAL_SIZE;
-  if (SDL_BlitSurface(menu_zone_surfaces[prevItem], &menu_blit_window, screen, NULL)) {
-    MENU_ERROR_PRINTF("ERROR Could not Blit surface on screen: %s\n", SDL_GetError());
+  SDL_FreeSurface(surface);
+  return converted;
+}
+
+/* single file holding all menu resources so that loading them costs one mapping instead of an open and a decode
+   for each one. Images are stored already decoded, as RGB565 if opaque or ARGB8888 otherwise, and fonts as they are.
+   Layout is a header, followed by the entry table and the 4 bytes aligned blobs, in native byte order */
+class ResourceBundle
+{
+private:
+  static constexpr uint32_t VERSION = 1;
+
+  enum : uint32_t { ENTRY_IMAGE = 1, ENTRY_FILE = 2 };
+
+  struct Header
+  {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+  };
+
+  struct Entry
+  {
+    char name[32];
+    uint32_t type;
+    uint32_t offset;
+    uint32_t size;
+    uint16_t w, h, pitch;
+    uint8_t bpp;
+    uint8_t reserved;
+    uint32_t rmask, gmask, bmask, amask;
+  };
+
+  uint8_t* data;
+  size_t size;
+
+  static uint32_t align(uint32_t offset) { return (offset + 3) & ~3u; }
+
+  const Entry* find(const path_t& name, uint32_t type) const
+  {
+    if (!data)
+      return nullptr;
+
+    const Header* header = reinterpret_cast<const Header*>(data);
+    const Entry* entries = reinterpret_cast<const Entry*>(data + sizeof(Header));
+
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+      const Entry& entry = entries[i];
+      if (entry.type == type && strncmp(entry.name, name.c_str(), sizeof(entry.name)) == 0)
+        return (size_t)entry.offset + entry.size <= size ? &entry : nullptr;
+    }
+
+    return nullptr;
   }
 
-  /// --------- Blit new menu Zone going in (only during animations) ----------
-  if (scroll > 0) {
-    menu_blit_window.y = SCREEN_VERTICAL_SIZE - scroll;
-    menu_blit_window.h = SCREEN_VERTICAL_SIZE;
-    if (SDL_BlitSurface(menu_zone_surfaces[menuItem], NULL, screen, &menu_blit_window)) {
-      MENU_ERROR_PRINTF("ERROR Could not Blit surface on screen: %s\n", SDL_GetError());
+  static bool readFile(const path_t& path, std::vector<uint8_t>& blob)
+  {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+      return false;
+
+    uint8_t buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+      blob.insert(blob.end(), buffer, buffer + read);
+
+    fclose(fp);
+    return true;
+  }
+
+public:
+  ResourceBundle() : data(nullptr), size(0) { }
+  ~ResourceBundle() { close(); }
+
+  bool open(const path_t& path)
+  {
+    close();
+
+    data = static_cast<uint8_t*>(Platform::mapFile(path, size));
+    if (!data)
+      return false;
+
+    const Header* header = reinterpret_cast<const Header*>(data);
+    if (size < sizeof(Header) || memcmp(header->magic, "FKRB", 4) != 0 || header->version != VERSION ||
+      sizeof(Header) + (size_t)header->count * sizeof(Entry) > size)
+    {
+      MENU_ERROR_PRINTF("ERROR Invalid resource bundle %s\n", path.c_str());
+      close();
+      return false;
     }
+
+    return true;
   }
-  else if (scroll < 0) {
-    menu_blit_window.y = SCREEN_VERTICAL_SIZE + scroll;
-    menu_blit_window.h = SCREEN_VERTICAL_SIZE;
-    if (SDL_BlitSurface(menu_zone_surfaces[menuItem], &menu_blit_window, screen, NULL)) {
-      MENU_ERROR_PRINTF("ERROR Could not Blit surface on screen: %s\n", SDL_GetError());
+
+  void close()
+  {
+    if (data)
+      Platform::unmapFile(data, size);
+    data = nullptr;
+    size = 0;
+  }
+
+  bool isOpen() const { return data != nullptr; }
+
+  /* surface using the pixels in the bundle, it must be freed before close() */
+  SDL_Surface* image(const path_t& name) const
+  {
+    const Entry* entry = find(name, ENTRY_IMAGE);
+    if (!entry)
+      return nullptr;
+
+    /* pixels must lie within the entry, rows at least as wide as the image */
+    if ((entry->bpp != 16 && entry->bpp != 32) || entry->pitch < entry->w * (entry->bpp / 8) ||
+      (size_t)entry->pitch * entry->h > entry->size)
+    {
+      MENU_ERROR_PRINTF("ERROR Invalid image %s in resource bundle\n", name.c_str());
+      return nullptr;
     }
+
+    return SDL_CreateRGBSurfaceFrom(data + entry->offset, entry->w, entry->h, entry->bpp, entry->pitch,
+      entry->rmask, entry->gmask, entry->bmask, entry->amask);
   }
-  /// --------- No Scroll ? Blitting menu-specific info
-  else {
-    SDL_Surface* text_surface = NULL;
-    char text_tmp[100];
-    SDL_Rect text_pos;
-#ifdef HAS_MENU_THEME
-    char* curLayoutName;
-    bool dots = false;
-    int max_chars = 15;
-#endif
 
-    switch (idx_menus[menuItem]) {
-#ifdef HAS_MENU_VOLUME
-    case MENU_TYPE_VOLUME:
-      draw_progress_bar(screen, x_volume_bar, y_volume_bar,
-        width_progress_bar, height_progress_bar, volume_percentage, 100 / STEP_CHANGE_VOLUME);
-      break;
-#endif
-#ifdef HAS_MENU_BRIGHTNESS
-    case MENU_TYPE_BRIGHTNESS:
-      draw_progress_bar(screen, x_volume_bar, y_volume_bar,
-        width_progress_bar, height_progress_bar, brightness_percentage, 100 / STEP_CHANGE_BRIGHTNESS);
-      break;
-#endif
-#ifdef HAS_MENU_SAVE
-    case MENU_TYPE_SAVE:
-      /// ---- Write slot -----
-      sprintf(text_tmp, "IN SLOT   < %d >", savestate_slot + 1);
-      menu.printCentered(menu.fontInfo, text_tmp, text_color, 0, screen);
+  /* font reading from the bundle, it must be closed before close() */
+  TTF_Font* font(const path_t& name, int ptsize) const
+  {
+    const Entry* entry = find(name, ENTRY_FILE);
+    if (!entry)
+      return nullptr;
 
-      if (menu_action) {
-        sprintf(text_tmp, "Saving...");
-        text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-      }
-      else {
-        if (menu_confirmation) {
-          sprintf(text_tmp, "Are you sure?");
-          text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-        }
-        else {
-          /// ---- Write current Save state ----
-        }
+    SDL_RWops* rw = SDL_RWFromConstMem(data + entry->offset, entry->size);
+    return rw ? TTF_OpenFontRW(rw, 1, ptsize) : nullptr;
+  }
+
+  /* packs loose images and files found in directory into a bundle at path */
+  static bool write(const path_t& path, const path_t& directory, const std::vector<path_t>& images, const std::vector<path_t>& files)
+  {
+    std::vector<Entry> entries;
+    std::vector<std::vector<uint8_t>> blobs;
+
+    for (const path_t& name : images)
+    {
+      SDL_Surface* loaded = IMG_Load((directory + name).c_str());
+      if (!loaded) {
+        MENU_ERROR_PRINTF("ERROR IMG_Load: %s\n", IMG_GetError());
+        return false;
       }
 
-      if (text_surface)
-      {
-        text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-        text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 + 2 * padding_y_from_center_menu_zone;
-        SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
+      bool hasAlpha = loaded->format->Amask != 0;
+      SDL_Surface* reference = hasAlpha ?
+        SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000) :
+        SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 16, 0xF800, 0x07E0, 0x001F, 0);
+      SDL_Surface* packed = reference ? SDL_ConvertSurface(loaded, reference->format, SDL_SWSURFACE) : nullptr;
+      SDL_FreeSurface(reference);
+      SDL_FreeSurface(loaded);
+      if (!packed) {
+        MENU_ERROR_PRINTF("ERROR Could not convert %s: %s\n", name.c_str(), SDL_GetError());
+        return false;
       }
-      break;
-#endif
-#ifdef HAS_MENU_LOAD
-    case MENU_TYPE_LOAD:
-      /// ---- Write slot -----
-      sprintf(text_tmp, "FROM SLOT   < %d >", savestate_slot + 1);
-      menu.printCentered(menu.fontInfo, text_tmp, text_color, 0, screen);
 
+      Entry entry = { };
+      strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+      entry.type = ENTRY_IMAGE;
+      entry.w = packed->w;
+      entry.h = packed->h;
+      entry.pitch = packed->pitch;
+      entry.bpp = packed->format->BitsPerPixel;
+      entry.rmask = packed->format->Rmask;
+      entry.gmask = packed->format->Gmask;
+      entry.bmask = packed->format->Bmask;
+      entry.amask = packed->format->Amask;
+
+      SDL_LockSurface(packed);
+      const uint8_t* pixels = static_cast<const uint8_t*>(packed->pixels);
+      blobs.emplace_back(pixels, pixels + packed->pitch * packed->h);
+      SDL_UnlockSurface(packed);
+      SDL_FreeSurface(packed);
+
+      entry.size = blobs.back().size();
+      entries.push_back(entry);
+    }
 
-      if (menu_action) {
-        sprintf(text_tmp, "Loading...");
-        text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-      }
-      else {
-        if (menu_confirmation) {
-          sprintf(text_tmp, "Are you sure?");
-          text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-        }
-        else {
-          /// ---- Write current Load state ----
-        }
+    for (const path_t& name : files)
+    {
+      blobs.emplace_back();
+      if (!readFile(directory + name, blobs.back())) {
+        MENU_ERROR_PRINTF("ERROR Could not read %s\n", (directory + name).c_str());
+        return false;
       }
 
-      if (text_surface)
-      {
-        text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-        text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 + 2 * padding_y_from_center_menu_zone;
-        SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
-      }
-      break;
-#endif
-#ifdef HAS_MENU_ASPECT_RATIO
-    case MENU_TYPE_ASPECT_RATIO:
-      sprintf(text_tmp, "<   %s   >", aspect_ratio_name[aspect_ratio]);
-      menu.printCentered(menu.fontInfo, text_tmp, text_color, +1, screen);
-      break;
-#endif
-#ifdef HAS_MENU_USB
-    case MENU_TYPE_USB:
-      /// ---- Write slot -----
-      sprintf(text_tmp, "%s USB", usb_sharing ? "EJECT" : "MOUNT");
-      text_surface = TTF_RenderText_Blended(menu.fontTitle, text_tmp, text_color);
-      text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-      text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2;
-      SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
-
-      if (menu_action) {
-        sprintf(text_tmp, "in progress ...");
-        text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-        text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-        text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 + 2 * padding_y_from_center_menu_zone;
-        SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
-      }
-      else if (menu_confirmation) {
-        sprintf(text_tmp, "Are you sure?");
-        text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-        text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-        text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 + 2 * padding_y_from_center_menu_zone;
-        SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
-      }
-      else {
-        ///Nothing
-      }
-      break;
-#endif
-#ifdef HAS_MENU_THEME
-    case MENU_TYPE_THEME:
-      /// ---- Write current chosen theme -----
-      curLayoutName = (char*)Utils::getFileName(config->layouts_.at(indexChooseLayout)).c_str();
+      Entry entry = { };
+      strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+      entry.type = ENTRY_FILE;
+      entry.size = blobs.back().size();
+      entries.push_back(entry);
+    }
 
-      // no more than max_chars chars in name to fit screen
-      if (strlen(curLayoutName) > max_chars) {
-        curLayoutName[max_chars - 2] = 0;
-        dots = true;
-      }
-      sprintf(text_tmp, "< %s%s >", curLayoutName, dots ? "..." : "");
-
-      text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-      text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-      text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2;
-      SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
-
-      if (menu_action) {
-        sprintf(text_tmp, "In progress...");
-        text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-        text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-        text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 + 2 * padding_y_from_center_menu_zone;
-        SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
-      }
-      else if (menu_confirmation) {
-        sprintf(text_tmp, "Are you sure?");
-        text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-        text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-        text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 + 2 * padding_y_from_center_menu_zone;
-        SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
-      }
-      break;
-#endif
-#ifdef HAS_MENU_LAUNCHER
-    case MENU_TYPE_LAUNCHER:
-      if (menu_action) {
-        sprintf(text_tmp, "In progress...");
-        text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-        text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-        text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 + 2 * padding_y_from_center_menu_zone;
-        SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
-      }
-      else if (menu_confirmation) {
-        sprintf(text_tmp, "Are you sure?");
-        text_surface = TTF_RenderText_Blended(menu.fontInfo, text_tmp, text_color);
-        text_pos.x = (screen->w - MENU_ZONE_WIDTH) / 2 + (MENU_ZONE_WIDTH - text_surface->w) / 2;
-        text_pos.y = screen->h - MENU_ZONE_HEIGHT / 2 - text_surface->h / 2 + 2 * padding_y_from_center_menu_zone;
-        SDL_BlitSurface(text_surface, NULL, screen, &text_pos);
-      }
-      break;
-#endif
-#ifdef HAS_MENU_EXIT
-    case MENU_TYPE_EXIT:
-#endif
-#ifdef HAS_MENU_POWERDOWN
-    case MENU_TYPE_POWERDOWN:
-#endif
-#if defined(HAS_MENU_EXIT) || defined(HAS_MENU_POWERDOWN)
-      if (menu_action) {
-        menu.printCentered(menu.fontInfo, "Shutting down...", text_color, +2, screen);
-      }
-      else if (menu_confirmation) {
-          menu.printCentered(menu.fontInfo, "Are you sure?", text_color, +2, screen);
-      }
-      break;
-#endif
-#ifdef HAS_MENU_RO_RW
-    case MENU_TYPE_RO_RW:
-      menu.printCentered(menu.fontInfo, read_write ? "READ-ONLY" : "READ-WRITE", text_color, 0, screen);
+    /// ------ Blobs follow the entry table ------
+    uint32_t offset = align(sizeof(Header) + entries.size() * sizeof(Entry));
+    for (Entry& entry : entries)
+    {
+      entry.offset = offset;
+      offset = align(offset + entry.size);
+    }
 
-      if (menu_action) {
-        menu.printCentered(menu.fontInfo, "in progress ...", text_color, +2, screen);
-      }
-      else if (menu_confirmation) {
-        menu.printCentered(menu.fontInfo, "Are you sure?", text_color, +2, screen);
-      }
-      else {
-        ///Nothing
-      }
-      break;
-#endif
-    default:
-      break;
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+      MENU_ERROR_PRINTF("ERROR Could not create resource bundle %s\n", path.c_str());
+      return false;
     }
 
-    /// ------ Free Surfaces -------
-    if (text_surface)
-      SDL_FreeSurface(text_surface);
-  }
+    Header header = { { 'F', 'K', 'R', 'B' }, VERSION, (uint32_t)entries.size() };
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(entries.data(), sizeof(Entry), entries.size(), fp) == entries.size();
 
-  /// --------- Print arrows --------
-  if (print_arrows) {
-    /// Top arrow
-    SDL_Rect pos_arrow_top;
-    pos_arrow_top.x = (screen->w - menu.upArrow->w) / 2;
-    pos_arrow_top.y = (screen->h - MENU_BG_SQUREE_HEIGHT) / 4 - menu.upArrow->h / 2;
-    SDL_BlitSurface(menu.upArrow, NULL, screen, &pos_arrow_top);
+    static const uint8_t padding[4] = { 0 };
+    for (size_t i = 0; ok && i < entries.size(); i++)
+    {
+      long position = ftell(fp);
+      ok = position >= 0 && fwrite(padding, 1, entries[i].offset - position, fp) == entries[i].offset - (size_t)position;
+      ok = ok && fwrite(blobs[i].data(), 1, blobs[i].size(), fp) == blobs[i].size();
+    }
 
-    /// Bottom arrow
-    SDL_Rect pos_arrow_bottom;
-    pos_arrow_bottom.x = (screen->w - menu.downArrow->w) / 2;
-    pos_arrow_bottom.y = screen->h -
-      (screen->h - MENU_BG_SQUREE_HEIGHT) / 4 - menu.downArrow->h / 2;
-    SDL_BlitSurface(menu.downArrow, NULL, screen, &pos_arrow_bottom);
+    fclose(fp);
+    if (!ok) {
+      MENU_ERROR_PRINTF("ERROR Could not write resource bundle %s\n", path.c_str());
+      remove(path.c_str());
+    }
+    return ok;
   }
+};
 
-  /// --------- Flip Screen ----------
-  SDL_Flip(screen);
-}
+/* 64 bit FNV-1a, enough to tell apart the inputs a cached file was built from */
+struct Fnv1a
+{
+  uint64_t value = 14695981039346656037ull;
 
+  void add(const void* data, size_t length)
+  {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < length; i++)
+      value = (value ^ bytes[i]) * 1099511628211ull;
+  }
 
-int FK_RunMenu(SDL_Surface* screen)
+  template<typename T> void add(const T& data) { add(&data, sizeof(T)); }
+};
+
+/* opt-in file holding the fully composed zone surfaces, a warm start loads their pixels instead of
+   rasterizing captions and bars again. It is discarded as soon as the key it was saved with changes */
+class ZoneCache
 {
-  menu.setScreen(screen);
-  
-  MENU_DEBUG_PRINTF("Run Menu\n");
+private:
+  static constexpr uint32_t VERSION = 1;
 
-  SDL_Event event;
-  uint32_t prev_ms = SDL_GetTicks();
-  uint32_t cur_ms = SDL_GetTicks();
-  int scroll = 0;
-  int start_scroll = 0;
-  uint8_t screen_refresh = 1;
-  char shell_cmd[100];
-  FILE* fp;
-  uint8_t menu_confirmation = 0;
-  stop_menu_loop = 0;
-#ifdef HAS_MENU_THEME
-  indexChooseLayout = config->currentLayoutIdx_;
-#endif
-  int returnCode = MENU_RETURN_OK;
+  struct Header
+  {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t count;
+  };
 
-  /// ------ Get System values -------
-  init_menu_system_values();
-  int prevItem = menuItem;
+  struct Zone
+  {
+    uint32_t type;
+    uint16_t w, h, pitch;
+    uint8_t bpp;
+    uint8_t reserved;
+    uint32_t rmask, gmask, bmask, amask;
+  };
 
-  /// Save prev key repeat params and set new Key repeat
-  SDL_GetKeyRepeat(&backup_key_repeat_delay, &backup_key_repeat_interval);
-  if (SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL)) {
-    MENU_ERROR_PRINTF("ERROR with SDL_EnableKeyRepeat: %s\n", SDL_GetError());
-  }
+  path_t path;
 
-#if defined(HAS_MENU_SAVE) || defined(HAS_MENU_LOAD)
-  /// Get save slot from game
-  savestate_slot = (savestate_slot % MAX_SAVE_SLOTS); // security
-#endif
+public:
+  static constexpr uint32_t version() { return VERSION; }
 
-  /// ------ Backup currently displayed app screen -------
-  background_screen = SDL_CreateRGBSurface(SDL_SWSURFACE,
-    screen->w, screen->h, 32, 0, 0, 0, 0);
-  if (background_screen == NULL) {
-    MENU_ERROR_PRINTF("ERROR Could not create background_screen: %s\n", SDL_GetError());
-    return MENU_RETURN_ERROR;
-  }
-  if (SDL_BlitSurface(screen, NULL, background_screen, NULL)) {
-    MENU_ERROR_PRINTF("ERROR Could not copy screen: %s\n", SDL_GetError());
-  }
+  void setPath(const path_t& path) { this->path = path; }
+  bool isEnabled() const { return !path.empty(); }
 
-  /// -------- Main loop ---------
-  while (!stop_menu_loop)
+  /* fills zones with one new surface per type if the cache matches key, nothing otherwise */
+  bool load(uint64_t key, const std::vector<ENUM_MENU_TYPE>& types, std::vector<SDL_Surface*>& zones) const
   {
-    /// -------- Handle Keyboard Events ---------
-    if (!scroll) {
-      while (SDL_PollEvent(&event))
-        switch (event.type)
-        {
-        case SDL_QUIT:
-          stop_menu_loop = 1;
-          returnCode = MENU_RETURN_EXIT;
-          break;
-        case SDL_KEYDOWN:
-          switch (event.key.keysym.sym)
-          {
-          case SDLK_b:
-            if (menu_confirmation) {
-              /// ------ Reset menu confirmation ------
-              menu_confirmation = 0;
-              /// ------ Refresh screen ------
-              screen_refresh = 1;
-            }
-            /*else{
-              stop_menu_loop = 1;
-            }*/
-            break;
-
-          case SDLK_q:
-          case SDLK_ESCAPE:
-            /// ------ Check if no action ------
-#ifdef HAS_MENU_USB
-            if (usb_sharing) {
-              break;
-            }
-#endif
-            stop_menu_loop = 1;
-            break;
+    size_t size = 0;
+    uint8_t* data = static_cast<uint8_t*>(Platform::mapFile(path, size));
+    if (!data)
+      return false;
+
+    const Header* header = reinterpret_cast<const Header*>(data);
+    bool valid = size >= sizeof(Header) && memcmp(header->magic, "FKZC", 4) == 0 && header->version == VERSION &&
+      header->key == key && header->count == types.size();
+
+    size_t offset = sizeof(Header);
+    for (size_t i = 0; valid && i < types.size(); i++)
+    {
+      const Zone* zone = reinterpret_cast<const Zone*>(data + offset);
+      offset += sizeof(Zone);
+      if (offset > size || zone->type != (uint32_t)types[i] || offset + (size_t)zone->pitch * zone->h > size) {
+        valid = false;
+        break;
+      }
 
-          case SDLK_d:
-          case SDLK_DOWN:
-            MENU_DEBUG_PRINTF("DOWN\n");
-            /// ------ Check if no action ------
-#ifdef HAS_MENU_USB
-            if (usb_sharing) {
-              break;
-            }
-#endif
-            /// ------ Start scrolling to new menu -------
-            menuItem++;
-            if (menuItem >= nb_menu_zones) menuItem = 0;
+      SDL_Surface* surface = SDL_CreateRGBSurface(SDL_SWSURFACE, zone->w, zone->h, zone->bpp,
+        zone->rmask, zone->gmask, zone->bmask, zone->amask);
+      if (!surface) {
+        valid = false;
+        break;
+      }
 
-#ifdef HAS_MENU_USB
-            /// Skip if usb menu if usb not connected
-            if (idx_menus[menuItem] == MENU_TYPE_USB && !usb_data_connected) {
-              menuItem++;
-              if (menuItem >= nb_menu_zones) menuItem = 0;
-            }
-#endif
-            start_scroll = 1;
+      SDL_LockSurface(surface);
+      const uint8_t* pixels = data + offset;
+      uint16_t rowLength = MIN(zone->pitch, surface->pitch);
+      for (int y = 0; y < zone->h; y++)
+        memcpy(static_cast<uint8_t*>(surface->pixels) + y * surface->pitch, pixels + y * zone->pitch, rowLength);
+      SDL_UnlockSurface(surface);
+
+      zones.push_back(surface);
+      offset += (size_t)zone->pitch * zone->h;
+    }
 
-            /// ------ Reset menu confirmation ------
-            menu_confirmation = 0;
+    Platform::unmapFile(data, size);
 
-            /// ------ Refresh screen ------
-            screen_refresh = 1;
-            break;
+    if (!valid)
+    {
+      MENU_DEBUG_PRINTF("Zone cache %s is stale\n", path.c_str());
+      for (SDL_Surface* surface : zones)
+        SDL_FreeSurface(surface);
+      zones.clear();
+    }
 
-          case SDLK_u:
-          case SDLK_UP:
-            MENU_DEBUG_PRINTF("UP\n");
-            /// ------ Check if no action ------
-#ifdef HAS_MENU_USB
-            if (usb_sharing) {
-              break;
-            }
-#endif
-            /// ------ Start scrolling to new menu -------
-            menuItem--;
-            if (menuItem < 0) menuItem = nb_menu_zones - 1;
+    return valid;
+  }
 
-#ifdef HAS_MENU_USB
-            /// Skip if usb menu if usb not connected
-            if (idx_menus[menuItem] == MENU_TYPE_USB && !usb_data_connected) {
-              menuItem--;
-              if (menuItem < 0) menuItem = nb_menu_zones - 1;
-            }
-#endif
-            start_scroll = -1;
+  /* written to a temporary file first so that an interrupted save never leaves a truncated cache */
+  bool save(uint64_t key, const std::vector<ENUM_MENU_TYPE>& types, const std::vector<SDL_Surface*>& zones) const
+  {
+    path_t temporary = path + ".tmp";
+    FILE* fp = fopen(temporary.c_str(), "wb");
+    if (!fp) {
+      MENU_ERROR_PRINTF("ERROR Could not create zone cache %s\n", temporary.c_str());
+      return false;
+    }
 
-            /// ------ Reset menu confirmation ------
-            menu_confirmation = 0;
+    Header header = { { 'F', 'K', 'Z', 'C' }, VERSION, key, (uint32_t)types.size() };
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
 
-            /// ------ Refresh screen ------
-            screen_refresh = 1;
-            break;
+    for (size_t i = 0; ok && i < types.size(); i++)
+    {
+      SDL_Surface* surface = zones[i];
+      const SDL_PixelFormat* format = surface->format;
+      Zone zone = { (uint32_t)types[i], (uint16_t)surface->w, (uint16_t)surface->h, surface->pitch, format->BitsPerPixel, 0,
+        format->Rmask, format->Gmask, format->Bmask, format->Amask };
 
-          case SDLK_l:
-          case SDLK_LEFT:
-            //MENU_DEBUG_PRINTF("LEFT\n");
-#ifdef HAS_MENU_VOLUME
-            if (idx_menus[menuItem] == MENU_TYPE_VOLUME) {
-              MENU_DEBUG_PRINTF("Volume DOWN\n");
-              /// ----- Compute new value -----
-              volume_percentage = (volume_percentage < STEP_CHANGE_VOLUME) ?
-                0 : (volume_percentage - STEP_CHANGE_VOLUME);
-
-              /// ----- Shell cmd ----
-              sprintf(shell_cmd, "%s %d", SHELL_CMD_VOLUME_SET, volume_percentage);
-              fp = Platform::platformPopen(shell_cmd, "r");
-              if (fp == NULL) {
-                MENU_ERROR_PRINTF("Failed to run command %s\n", shell_cmd);
-              }
-
-              /// ------ Refresh screen ------
-              screen_refresh = 1;
-            }
-            else
-#endif
-#ifdef HAS_MENU_BRIGHTNESS
-              if (idx_menus[menuItem] == MENU_TYPE_BRIGHTNESS) {
-                MENU_DEBUG_PRINTF("Brightness DOWN\n");
-                /// ----- Compute new value -----
-                brightness_percentage = (brightness_percentage < STEP_CHANGE_BRIGHTNESS) ?
-                  0 : (brightness_percentage - STEP_CHANGE_BRIGHTNESS);
-
-                /// ----- Shell cmd ----
-                sprintf(shell_cmd, "%s %d", SHELL_CMD_BRIGHTNESS_SET, brightness_percentage);
-                fp = Platform::platformPopen(shell_cmd, "r");
-                if (fp == NULL) {
-                  MENU_ERROR_PRINTF("Failed to run command %s\n", shell_cmd);
-                }
-                /// ------ Refresh screen ------
-                screen_refresh = 1;
-              }
-              else
-#endif
-#ifdef HAS_MENU_LOAD
-                if (idx_menus[menuItem] == MENU_TYPE_SAVE) {
-                  MENU_DEBUG_PRINTF("Save Slot DOWN\n");
-                  savestate_slot = (!savestate_slot) ? (MAX_SAVE_SLOTS - 1) : (savestate_slot - 1);
-                  /// ------ Refresh screen ------
-                  screen_refresh = 1;
-                }
-                else
-#endif
-#ifdef HAS_MENU_LOAD
-                  if (idx_menus[menuItem] == MENU_TYPE_LOAD) {
-                    MENU_DEBUG_PRINTF("Load Slot DOWN\n");
-                    //idx_load_slot = (!idx_load_slot)?(MAX_SAVE_SLOTS-1):(idx_load_slot-1);
-                    savestate_slot = (!savestate_slot) ? (MAX_SAVE_SLOTS - 1) : (savestate_slot - 1);
-                    /// ------ Refresh screen ------
-                    screen_refresh = 1;
-                  }
-                  else
-#endif
-#ifdef HAS_MENU_ASPECT_RATIO
-                    if (idx_menus[menuItem] == MENU_TYPE_ASPECT_RATIO) {
-                      MENU_DEBUG_PRINTF("Aspect Ratio DOWN\n");
-                      aspect_ratio = (!aspect_ratio) ? (NB_ASPECT_RATIOS_TYPES - 1) : (aspect_ratio - 1);
-                      /// ------ Refresh screen ------
-                      screen_refresh = 1;
-                    }
-                    else
-#endif
-#ifdef HAS_MENU_THEME
-                      if (idx_menus[menuItem] == MENU_TYPE_THEME) {
-                        MENU_DEBUG_PRINTF("Theme previous\n");
-                        indexChooseLayout = (!indexChooseLayout) ? (config->layouts_.size() - 1) : (indexChooseLayout - 1);
-                        /// ------ Refresh screen ------
-                        screen_refresh = 1;
-                      }
-                      else
-#endif
-                      {
-                      }
-            break;
-
-          case SDLK_r:
-          case SDLK_RIGHT:
-            //MENU_DEBUG_PRINTF("RIGHT\n");
-#ifdef HAS_MENU_VOLUME
-            if (idx_menus[menuItem] == MENU_TYPE_VOLUME) {
-              MENU_DEBUG_PRINTF("Volume UP\n");
-              /// ----- Compute new value -----
-              volume_percentage = (volume_percentage > 100 - STEP_CHANGE_VOLUME) ?
-                100 : (volume_percentage + STEP_CHANGE_VOLUME);
-
-              /// ----- Shell cmd ----
-              sprintf(shell_cmd, "%s %d", SHELL_CMD_VOLUME_SET, volume_percentage);
-              fp = Platform::platformPopen(shell_cmd, "r");
-              if (fp == NULL) {
-                MENU_ERROR_PRINTF("Failed to run command %s\n", shell_cmd);
-              }
-              /// ------ Refresh screen ------
-              screen_refresh = 1;
-            }
-            else
-#endif
-#ifdef HAS_MENU_BRIGHTNESS
-              if (idx_menus[menuItem] == MENU_TYPE_BRIGHTNESS) {
-                MENU_DEBUG_PRINTF("Brightness UP\n");
-                /// ----- Compute new value -----
-                brightness_percentage = (brightness_percentage > 100 - STEP_CHANGE_BRIGHTNESS) ?
-                  100 : (brightness_percentage + STEP_CHANGE_BRIGHTNESS);
-
-                /// ----- Shell cmd ----
-                sprintf(shell_cmd, "%s %d", SHELL_CMD_BRIGHTNESS_SET, brightness_percentage);
-                fp = Platform::platformPopen(shell_cmd, "r");
-                if (fp == NULL) {
-                  MENU_ERROR_PRINTF("Failed to run command %s\n", shell_cmd);
-                }
-                /// ------ Refresh screen ------
-                screen_refresh = 1;
-              }
-              else
-#endif
-#ifdef HAS_MENU_SAVE
-                if (idx_menus[menuItem] == MENU_TYPE_SAVE) {
-                  MENU_DEBUG_PRINTF("Save Slot UP\n");
-                  savestate_slot = (savestate_slot + 1) % MAX_SAVE_SLOTS;
-                  /// ------ Refresh screen ------
-                  screen_refresh = 1;
-                }
-                else
-#endif
-#ifdef HAS_MENU_LOAD
-                  if (idx_menus[menuItem] == MENU_TYPE_LOAD) {
-                    MENU_DEBUG_PRINTF("Load Slot UP\n");
-                    //idx_load_slot = (idx_load_slot+1)%MAX_SAVE_SLOTS;
-                    savestate_slot = (savestate_slot + 1) % MAX_SAVE_SLOTS;
-                    /// ------ Refresh screen ------
-                    screen_refresh = 1;
-                  }
-                  else
-#endif
-#ifdef HAS_MENU_ASPECT_RATIO
-                    if (idx_menus[menuItem] == MENU_TYPE_ASPECT_RATIO) {
-                      MENU_DEBUG_PRINTF("Aspect Ratio UP\n");
-                      aspect_ratio = (aspect_ratio + 1) % NB_ASPECT_RATIOS_TYPES;
-                      /// ------ Refresh screen ------
-                      screen_refresh = 1;
-                    }
-                    else
-#endif
-#ifdef HAS_MENU_THEME
-                      if (idx_menus[menuItem] == MENU_TYPE_THEME) {
-                        MENU_DEBUG_PRINTF("Theme previous\n");
-                        indexChooseLayout = (indexChooseLayout + 1) % config->layouts_.size();
-                        /// ------ Refresh screen ------
-                        screen_refresh = 1;
-                      }
-                      else
-#endif
-                      {
-                      }
-            break;
-
-          case SDLK_a:
-          case SDLK_RETURN:
-#ifdef HAS_MENU_SAVE
-            if (idx_menus[menuItem] == MENU_TYPE_SAVE) {
-              if (menu_confirmation) {
-                MENU_DEBUG_PRINTF("Saving in slot %d\n", savestate_slot);
-                /// ------ Refresh Screen -------
-                menu_screen_refresh(screen, menuItem, prevItem, scroll, menu_confirmation, 1);
-
-                /// ------ Save game ------
-                stop_menu_loop = 1;
-              }
-              else {
-                MENU_DEBUG_PRINTF("Save game - asking confirmation\n");
-                menu_confirmation = 1;
-                /// ------ Refresh screen ------
-                screen_refresh = 1;
-              }
-            }
-            else
-#endif
-#ifdef HAS_MENU_LOAD
-              if (idx_menus[menuItem] == MENU_TYPE_LOAD) {
-                if (menu_confirmation) {
-                  MENU_DEBUG_PRINTF("Loading in slot %d\n", savestate_slot);
-                  /// ------ Refresh Screen -------
-                  menu_screen_refresh(screen, menuItem, prevItem, scroll, menu_confirmation, 1);
-
-                  /// ------ Load game ------
-                  stop_menu_loop = 1;
-                }
-                else {
-                  MENU_DEBUG_PRINTF("Save game - asking confirmation\n");
-                  menu_confirmation = 1;
-                  /// ------ Refresh screen ------
-                  screen_refresh = 1;
-                }
-              }
-              else
-#endif
-#ifdef HAS_MENU_USB
-                if (idx_menus[menuItem] == MENU_TYPE_USB) {
-                  MENU_DEBUG_PRINTF("USB %s\n", usb_sharing ? "unmount" : "mount");
-                  if (menu_confirmation) {
-                    MENU_DEBUG_PRINTF("%s USB - confirmed\n", usb_sharing ? "Unmount" : "Mount");
-                    /// ----- Refresh screen ----
-                    menu_screen_refresh(screen, menuItem, prevItem, scroll, menu_confirmation, 1);
-
-                    /// ----- Shell cmd ----
-                    /*fp = popen(usb_sharing?SHELL_CMD_USB_UNMOUNT:SHELL_CMD_USB_MOUNT, "r");
-                    if (fp == NULL) {
-                      MENU_ERROR_PRINTF("Failed to run command %s\n", shell_cmd);
-                    }
-                    else{
-                      usb_sharing = !usb_sharing;
-                    }*/
-
-                    bool res = Utils::executeRawPath(usb_sharing ? SHELL_CMD_USB_UNMOUNT : SHELL_CMD_USB_MOUNT);
-                    if (!res) {
-                      MENU_ERROR_PRINTF("Failed to run command %s\n", shell_cmd);
-                    }
-                    else {
-                      usb_sharing = !usb_sharing;
-                    }
-
-                    /// ------ Refresh screen ------
-                    menu_confirmation = 0;
-                    screen_refresh = 1;
-                  }
-                  else {
-                    MENU_DEBUG_PRINTF("%s USB - asking confirmation\n", usb_sharing ? "Unmount" : "Mount");
-                    menu_confirmation = 1;
-                    screen_refresh = 1;
-                  }
-                }
-                else
-#endif
-#ifdef HAS_MENU_THEME
-                  if (idx_menus[menuItem] == MENU_TYPE_THEME) {
-                    if (menu_confirmation) {
-                      MENU_DEBUG_PRINTF("Theme change - confirmed\n");
-
-                      /// ------ Refresh Screen -------
-                      menu_screen_refresh(screen, menuItem, prevItem, scroll, menu_confirmation, 1);
-
-                      /// ----- Write new theme and restart RetroFe ----
-                      config->exportCurrentLayout(Utils::combinePath(Configuration::absolutePath, "layout.conf"),
-                        Utils::getFileName(config->layouts_.at(indexChooseLayout)));
-                      stop_menu_loop = 1;
-                      returnCode = MENU_RETURN_EXIT;
-                    }
-                    else {
-                      MENU_DEBUG_PRINTF("Theme change - asking confirmation\n");
-                      menu_confirmation = 1;
-                      /// ------ Refresh screen ------
-                      screen_refresh = 1;
-                    }
-                  }
-                  else
-#endif
-#ifdef HAS_MENU_LAUNCHER
-                    if (idx_menus[menuItem] == MENU_TYPE_LAUNCHER) {
-                      if (menu_confirmation) {
-                        MENU_DEBUG_PRINTF("Lancher change - confirmed\n");
-
-                        /// ------ Refresh Screen -------
-                        menu_screen_refresh(screen, menuItem, prevItem, scroll, menu_confirmation, 1);
-
-                        /// ----- Shell cmd ----
-                        MENU_DEBUG_PRINTF("Running command: %s\n", SHELL_CMD_SET_LAUNCHER_GMENU2X);
-                        Utils::executeRawPath(SHELL_CMD_SET_LAUNCHER_GMENU2X);
-
-                        stop_menu_loop = 1;
-                        returnCode = MENU_RETURN_EXIT;
-                      }
-                      else {
-                        MENU_DEBUG_PRINTF("Launcher change - asking confirmation\n");
-                        menu_confirmation = 1;
-                        /// ------ Refresh screen ------
-                        screen_refresh = 1;
-                      }
-                    }
-                    else
-#endif
-#ifdef HAS_MENU_EXIT
-                      if (idx_menus[menuItem] == MENU_TYPE_EXIT) {
-                        MENU_DEBUG_PRINTF("Exit game\n");
-                        if (menu_confirmation) {
-                          MENU_DEBUG_PRINTF("Exit game - confirmed\n");
-                          /// ----- The game should be saved here ----
-
-                          /// ----- Exit game and back to launcher ----
-                          stop_menu_loop = 1;
-                          returnCode = MENU_RETURN_EXIT;
-                        }
-                        else {
-                          MENU_DEBUG_PRINTF("Exit game - asking confirmation\n");
-                          menu_confirmation = 1;
-                          /// ------ Refresh screen ------
-                          screen_refresh = 1;
-                        }
-                      }
-                      else
-#endif
-#ifdef HAS_MENU_POWERDOWN
-                        if (idx_menus[menuItem] == MENU_TYPE_POWERDOWN) {
-                          if (menu_confirmation) {
-                            MENU_DEBUG_PRINTF("Powerdown - confirmed\n");
-
-                            /// ------ Refresh Screen -------
-                            menu_screen_refresh(screen, menuItem, prevItem, scroll, menu_confirmation, 1);
-
-                            /// ----- Shell cmd ----
-                            sprintf(shell_cmd, "%s", SHELL_CMD_POWERDOWN);
-                            fp = Platform::platformPopen(shell_cmd, "r");
-                            if (fp == NULL) {
-                              MENU_ERROR_PRINTF("Failed to run command %s\n", shell_cmd);
-                            }
-
-                            return MENU_RETURN_EXIT;
-                          }
-                          else {
-                            MENU_DEBUG_PRINTF("Powerdown - asking confirmation\n");
-                            menu_confirmation = 1;
-                            /// ------ Refresh screen ------
-                            screen_refresh = 1;
-                          }
-                        }
-                        else
-#endif
-#ifdef HAS_MENU_RO_RW
-                          if (idx_menus[menuItem] == MENU_TYPE_RO_RW) {
-                            MENU_DEBUG_PRINTF("%s\n", read_write ? "RO" : "RW");
-                            if (menu_confirmation) {
-                              MENU_DEBUG_PRINTF("SYSTEM %s - confirmed\n", read_write ? "RO" : "RW");
-                              /// ----- Refresh screen ----
-                              menu_screen_refresh(screen, menuItem, prevItem, scroll, menu_confirmation, 1);
-
-                              /// ----- Shell cmd ----
-                              if (system(read_write ? SHELL_CMD_RO : SHELL_CMD_RW) < 0) {
-                                MENU_ERROR_PRINTF("Failed to run command %s\n", shell_cmd);
-                              }
-                              else {
-                                read_write = !read_write;
-                              }
-
-                              /// ------ Refresh screen ------
-                              menu_confirmation = 0;
-                              screen_refresh = 1;
-                            }
-                            else {
-                              MENU_DEBUG_PRINTF("SYSTEM %s - asking confirmation\n", read_write ? "RW" : "RO");
-                              menu_confirmation = 1;
-                              screen_refresh = 1;
-                            }
-                          }
-                          else
-#endif
-                          {
-                          }
-            break;
-
-          default:
-            //MENU_DEBUG_PRINTF("Keydown: %d\n", event.key.keysym.sym);
-            break;
-          }
-          break;
-        }
+      SDL_LockSurface(surface);
+      ok = fwrite(&zone, sizeof(zone), 1, fp) == 1 && fwrite(surface->pixels, surface->pitch, surface->h, fp) == (size_t)surface->h;
+      SDL_UnlockSurface(surface);
     }
 
-    /// --------- Handle Scroll effect ---------
-    if ((scroll > 0) || (start_scroll > 0)) {
-      scroll += MIN(SCROLL_SPEED_PX, MENU_ZONE_HEIGHT - scroll);
-      start_scroll = 0;
-      screen_refresh = 1;
-    }
-    else if ((scroll < 0) || (start_scroll < 0)) {
-      scroll -= MIN(SCROLL_SPEED_PX, MENU_ZONE_HEIGHT + scroll);
-      start_scroll = 0;
-      screen_refresh = 1;
-    }
-    if (scroll >= MENU_ZONE_HEIGHT || scroll <= -MENU_ZONE_HEIGHT) {
-      prevItem = menuItem;
-      scroll = 0;
-      screen_refresh = 1;
+    ok = fclose(fp) == 0 && ok;
+    if (ok)
+      ok = rename(temporary.c_str(), path.c_str()) == 0;
+    if (!ok) {
+      MENU_ERROR_PRINTF("ERROR Could not write zone cache %s\n", path.c_str());
+      remove(temporary.c_str());
     }
+    return ok;
+  }
+};
 
-    /// --------- Handle FPS ---------
-    cur_ms = SDL_GetTicks();
-    if (cur_ms - prev_ms < 1000 / FPS_MENU) {
-      SDL_Delay(1000 / FPS_MENU - (cur_ms - prev_ms));
-    }
-    prev_ms = SDL_GetTicks();
+/* two buffers handed back and forth between a producer and a consumer thread, one of them is filled while the
+   other one is drained. Either side can give up, which ends the stream for both */
+class ChunkPipe
+{
+public:
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
 
+private:
+  std::array<std::vector<uint8_t>, 2> buffers;
+  std::array<size_t, 2> sizes;
+  int head;       /* next buffer for the consumer */
+  int filled;     /* buffers waiting for the consumer */
+  bool ended;
+  bool failed;
+  std::mutex mutex;
+  std::condition_variable cond;
 
-    /// --------- Refresh screen
-    if (screen_refresh) {
-      menu_screen_refresh(screen, menuItem, prevItem, scroll, menu_confirmation, 0);
-    }
+public:
+  ChunkPipe() : sizes{ { 0, 0 } }, head(0), filled(0), ended(false), failed(false)
+  {
+    for (std::vector<uint8_t>& buffer : buffers)
+      buffer.resize(CHUNK_SIZE);
+  }
 
-    /// --------- reset screen refresh ---------
-    screen_refresh = 0;
+  /* producer: waits for a free buffer of CHUNK_SIZE bytes, nullptr once the stream failed */
+  uint8_t* acquire()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return filled < 2 || failed; });
+    return failed ? nullptr : buffers[(head + filled) % 2].data();
   }
 
-  /// ------ Reset prev key repeat params -------
-  if (SDL_EnableKeyRepeat(backup_key_repeat_delay, backup_key_repeat_interval)) {
-    MENU_ERROR_PRINTF("ERROR with SDL_EnableKeyRepeat: %s\n", SDL_GetError());
+  /* producer: hands the acquired buffer over with size bytes in it, last ends the stream */
+  void commit(size_t size, bool last)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    sizes[(head + filled) % 2] = size;
+    filled++;
+    ended = last;
+    cond.notify_all();
   }
 
-  /// --------- Clear HW screen ----------
-  if (SDL_BlitSurface(background_screen, NULL, screen, NULL)) {
-    MENU_ERROR_PRINTF("ERROR Could not Clear screen: %s\n", SDL_GetError());
+  /* consumer: waits for the next buffer, false at the end of the stream or once it failed */
+  bool next(const uint8_t*& data, size_t& size)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return filled > 0 || ended || failed; });
+    if (failed || !filled)
+      return false;
+
+    data = buffers[head].data();
+    size = sizes[head];
+    return true;
   }
 
-  /// --------- Flip Screen ----------
-  SDL_Flip(screen);
+  /* consumer: gives the buffer returned by next() back to the producer */
+  void release()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    head = (head + 1) % 2;
+    filled--;
+    cond.notify_all();
+  }
 
-  if (background_screen != NULL) {
-    SDL_FreeSurface(background_screen);
-    background_screen = NULL;
+  void fail()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    failed = true;
+    cond.notify_all();
   }
-  MENU_DEBUG_PRINTF("Leave Menu\n");
-  return returnCode;
-}
\ No newline at end of file
+
+  bool hasFailed()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return failed;
+  }
+};
+
+/* end of a ChunkPipe the host callbacks see, they write to it on save and read from it on load */
+struct FK_SaveStream
+{
+  ChunkPipe& pipe;
+  uint8_t* chunk;         /* writing: buffer being filled */
+  size_t used;
+  const uint8_t* data;    /* reading: rest of the buffer being drained */
+  size_t left;
+  bool holding;
+  bool ok;
+
+  FK_SaveStream(ChunkPipe& pipe) : pipe(pipe), chunk(nullptr), used(0), data(nullptr), left(0), holding(false), ok(true) { }
+
+  bool write(const void* source, size_t size)
+  {
+    const uint8_t* bytes = static_cast<const uint8_t*>(source);
+    while (ok && size)
+    {
+      if (!chunk && !(chunk = pipe.acquire()))
+      {
+        ok = false;
+        break;
+      }
+
+      size_t length = MIN(size, ChunkPipe::CHUNK_SIZE - used);
+      memcpy(chunk + used, bytes, length);
+      used += length;
+      bytes += length;
+      size -= length;
+
+      if (used == ChunkPipe::CHUNK_SIZE)
+      {
+        pipe.commit(used, false);
+        chunk = nullptr;
+        used = 0;
+      }
+    }
+    return ok;
+  }
+
+  bool read(void* dest, size_t size)
+  {
+    uint8_t* bytes = static_cast<uint8_t*>(dest);
+    while (ok && size)
+    {
+      if (!left)
+      {
+        if (holding)
+          pipe.release();
+        holding = pipe.next(data, left);
+        if (!holding)
+        {
+          ok = false;
+          break;
+        }
+        continue;
+      }
+
+      size_t length = MIN(size, left);
+      memcpy(bytes, data, length);
+      data += length;
+      left -= length;
+      bytes += length;
+      size -= length;
+    }
+    return ok;
+  }
+
+  /* writing: flushes the last chunk and ends the stream, or makes the other side give up if success is false */
+  void closeWrite(bool success)
+  {
+    if (success && ok && (chunk || (chunk = pipe.acquire())))
+      pipe.commit(used, true);
+    else
+      pipe.fail();
+    chunk = nullptr;
+  }
+
+  /* reading: the producer is stopped whether the whole state was read or not */
+  void closeRead()
+  {
+    if (holding)
+      pipe.release();
+    holding = false;
+    pipe.fail();
+  }
+};
+
+/* pages of a state which differ from the base image of its slot, LZ4 compressed when built with HAS_LZ4.
+   Layout is a header, then for each page its header followed by its data, in native byte order. Page data is
+   not padded, so page headers are copied out instead of being read in place */
+class StateDelta
+{
+public:
+  static constexpr size_t PAGE_SIZE = 4096;
+  static_assert(ChunkPipe::CHUNK_SIZE % PAGE_SIZE == 0, "chunks must hold whole pages");
+
+  struct Page
+  {
+    uint32_t index;
+    uint16_t length;        /* the last page of a state may be partial */
+    bool compressed;
+    std::vector<uint8_t> data;
+  };
+
+private:
+  static constexpr uint32_t VERSION = 1;
+
+  struct Header
+  {
+    char magic[4];
+    uint32_t version;
+    uint64_t baseSize;
+    int64_t baseTime;       /* a delta is only good for the base it was made against */
+    uint32_t pageSize;
+    uint32_t count;
+  };
+
+  struct PageHeader
+  {
+    uint32_t index;
+    uint32_t size;
+    uint16_t length;
+    uint16_t compressed;
+  };
+
+  /* offsets of the page headers in the mapped delta by page index, 0 for pages left as in the base */
+  const uint8_t* data = nullptr;
+  std::vector<size_t> table;
+
+  PageHeader pageAt(size_t offset) const
+  {
+    PageHeader page;
+    memcpy(&page, data + offset, sizeof(page));
+    return page;
+  }
+
+public:
+  static path_t pathFor(const path_t& state) { return state + ".delta"; }
+
+  static void encode(Page& page, uint32_t index, const uint8_t* data, size_t length)
+  {
+    page.index = index;
+    page.length = (uint16_t)length;
+    page.compressed = false;
+#ifdef HAS_LZ4
+    page.data.resize(LZ4_compressBound((int)length));
+    int size = LZ4_compress_default(reinterpret_cast<const char*>(data), reinterpret_cast<char*>(page.data.data()), (int)length, (int)page.data.size());
+    if (size > 0 && (size_t)size < length)
+    {
+      page.data.resize(size);
+      page.compressed = true;
+      return;
+    }
+#endif
+    page.data.assign(data, data + length);
+  }
+
+  static bool decode(const uint8_t* data, size_t size, bool compressed, uint8_t* dest, size_t length)
+  {
+#ifdef HAS_LZ4
+    if (compressed)
+      return LZ4_decompress_safe(reinterpret_cast<const char*>(data), reinterpret_cast<char*>(dest), (int)size, (int)length) == (int)length;
+#else
+    if (compressed)
+      return false;
+#endif
+    if (size != length)
+      return false;
+    memcpy(dest, data, length);
+    return true;
+  }
+
+  static bool decode(const Page& page, uint8_t* dest)
+  {
+    return decode(page.data.data(), page.data.size(), page.compressed, dest, page.length);
+  }
+
+  /* written to a temporary file first, like the states */
+  static bool write(const path_t& path, uint64_t baseSize, int64_t baseTime, const std::vector<Page>& pages)
+  {
+    path_t temporary = path + ".tmp";
+    FILE* fp = fopen(temporary.c_str(), "wb");
+    if (!fp) {
+      MENU_ERROR_PRINTF("ERROR Could not create save state delta %s\n", temporary.c_str());
+      return false;
+    }
+
+    Header header = { { 'F', 'K', 'S', 'D' }, VERSION, baseSize, baseTime, PAGE_SIZE, (uint32_t)pages.size() };
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (size_t i = 0; ok && i < pages.size(); i++)
+    {
+      const Page& page = pages[i];
+      PageHeader pageHeader = { page.index, (uint32_t)page.data.size(), page.length, page.compressed };
+      ok = fwrite(&pageHeader, sizeof(pageHeader), 1, fp) == 1 && fwrite(page.data.data(), 1, page.data.size(), fp) == page.data.size();
+    }
+
+    ok = Platform::syncFile(fp) && ok;
+    ok = fclose(fp) == 0 && ok;
+    if (ok)
+      ok = Platform::replaceFile(temporary, path);
+    if (!ok) {
+      MENU_ERROR_PRINTF("ERROR Could not write save state delta %s\n", path.c_str());
+      remove(temporary.c_str());
+    }
+    return ok;
+  }
+
+  /* indexes a mapped delta, false if it is damaged or does not match the base */
+  bool open(const uint8_t* data, size_t size, uint64_t baseSize, int64_t baseTime)
+  {
+    table.clear();
+    this->data = data;
+
+    Header header;
+    if (size < sizeof(Header))
+      return false;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "FKSD", 4) != 0 || header.version != VERSION ||
+      header.baseSize != baseSize || header.baseTime != baseTime || header.pageSize != PAGE_SIZE)
+      return false;
+
+    table.resize((baseSize + PAGE_SIZE - 1) / PAGE_SIZE, 0);
+    size_t offset = sizeof(Header);
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+      if (offset + sizeof(PageHeader) > size)
+      {
+        table.clear();
+        return false;
+      }
+      PageHeader page = pageAt(offset);
+      if (page.index >= table.size() || page.length > PAGE_SIZE || offset + sizeof(PageHeader) + page.size > size)
+      {
+        table.clear();
+        return false;
+      }
+      table[page.index] = offset;
+      offset += sizeof(PageHeader) + page.size;
+    }
+    return true;
+  }
+
+  /* overwrites the pages of the base which are in the delta, for a chunk of the base read at offset */
+  bool apply(uint8_t* chunk, size_t offset, size_t size) const
+  {
+    for (size_t at = 0; at < size; at += PAGE_SIZE)
+    {
+      size_t index = (offset + at) / PAGE_SIZE;
+      size_t pageOffset = index < table.size() ? table[index] : 0;
+      if (!pageOffset)
+        continue;
+
+      PageHeader page = pageAt(pageOffset);
+      if (page.length > size - at ||
+        !decode(data + pageOffset + sizeof(PageHeader), page.size, page.compressed != 0, chunk + at, page.length))
+        return false;
+    }
+    return true;
+  }
+};
+
+/* saves and loads states for the host through its callbacks. The state files are streamed to and from disk by the
+   command worker, and an index of the slots keeps their date and a thumbnail so that the slot picker never opens
+   the states themselves */
+class SaveStateService
+{
+public:
+  static constexpr int THUMBNAIL_SIZE = 40;
+  static constexpr int QUICK_SLOT = MAX_SAVE_SLOTS;    /* saved on exit, not shown by the slot picker */
+
+  struct Slot
+  {
+    int64_t time;           /* seconds since the epoch, 0 if the slot is empty */
+    uint32_t hasThumbnail;  /* states saved by the host alone have a date but no thumbnail */
+    uint16_t thumbnail[THUMBNAIL_SIZE * THUMBNAIL_SIZE];  /* RGB565 */
+  };
+
+private:
+  static constexpr uint32_t VERSION = 1;
+
+  struct Header
+  {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t thumbnailSize;
+  };
+
+  path_t path;
+  FK_SaveStateCallbacks callbacks;
+  int deltaPercent;
+
+  /* written by the worker once a state is on disk */
+  std::array<Slot, MAX_SAVE_SLOTS> slots;
+  uint32_t revision;
+  std::mutex mutex;
+
+  /* video thread only */
+  std::array<SDL_Surface*, MAX_SAVE_SLOTS> thumbnails;
+  std::array<uint32_t, MAX_SAVE_SLOTS> thumbnailRevision;
+
+  path_t statePath(int slot) const { return slot == QUICK_SLOT ? path + ".quick" : path + "." + std::to_string(slot + 1); }
+  path_t indexPath() const { return path + ".index"; }
+
+  void loadIndex()
+  {
+    for (Slot& slot : slots)
+      slot.time = slot.hasThumbnail = 0;
+
+    size_t size = 0;
+    uint8_t* data = static_cast<uint8_t*>(Platform::mapFile(indexPath(), size));
+    if (data)
+    {
+      const Header* header = reinterpret_cast<const Header*>(data);
+      if (size == sizeof(Header) + sizeof(slots) && memcmp(header->magic, "FKSI", 4) == 0 && header->version == VERSION &&
+        header->count == MAX_SAVE_SLOTS && header->thumbnailSize == THUMBNAIL_SIZE)
+      {
+        memcpy(slots.data(), data + sizeof(Header), sizeof(slots));
+      }
+      else
+      {
+        MENU_DEBUG_PRINTF("Save state index %s is stale\n", indexPath().c_str());
+      }
+      Platform::unmapFile(data, size);
+    }
+
+    /* a state may have been written or removed behind the index */
+    for (int i = 0; i < MAX_SAVE_SLOTS; i++)
+    {
+      int64_t time = Platform::modificationTime(statePath(i));
+      if (!time)
+        slots[i].time = slots[i].hasThumbnail = 0;
+      else if (!slots[i].time)
+        slots[i].time = time;
+    }
+  }
+
+  /* written to a temporary file first, like the states */
+  bool saveIndex(const std::array<Slot, MAX_SAVE_SLOTS>& slots) const
+  {
+    path_t temporary = indexPath() + ".tmp";
+    FILE* fp = fopen(temporary.c_str(), "wb");
+    if (!fp) {
+      MENU_ERROR_PRINTF("ERROR Could not create save state index %s\n", temporary.c_str());
+      return false;
+    }
+
+    Header header = { { 'F', 'K', 'S', 'I' }, VERSION, MAX_SAVE_SLOTS, THUMBNAIL_SIZE };
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(slots.data(), sizeof(slots), 1, fp) == 1;
+    ok = Platform::syncFile(fp) && ok;
+    ok = fclose(fp) == 0 && ok;
+    if (ok)
+      ok = Platform::replaceFile(temporary, indexPath());
+    if (!ok) {
+      MENU_ERROR_PRINTF("ERROR Could not write save state index %s\n", indexPath().c_str());
+      remove(temporary.c_str());
+    }
+    return ok;
+  }
+
+  /* full state made of the base and the pages of a delta over it, up to end */
+  static bool writeMerged(FILE* fp, const uint8_t* base, size_t baseSize, const std::vector<StateDelta::Page>& pages, size_t end)
+  {
+    uint8_t page[StateDelta::PAGE_SIZE];
+    size_t next = 0;
+    for (size_t offset = 0; offset < end; offset += StateDelta::PAGE_SIZE)
+    {
+      size_t length = MIN(StateDelta::PAGE_SIZE, end - offset);
+      const uint8_t* data = base + offset;
+      if (next < pages.size() && pages[next].index == offset / StateDelta::PAGE_SIZE)
+      {
+        if (!StateDelta::decode(pages[next++], page))
+          return false;
+        data = page;
+      }
+      /* pages past the end of the base are always in the delta */
+      else if (offset + length > baseSize)
+        return false;
+
+      if (fwrite(data, 1, length, fp) != length)
+        return false;
+    }
+    return true;
+  }
+
+  /* worker side of a save: drains the pipe to a temporary file which replaces the state once complete. With
+     deltas on and a base already there, only the pages which differ from it are kept, until they are more than
+     deltaPercent of it or the state size changes, the full state is then written as the new base */
+  static bool writeState(ChunkPipe& pipe, const path_t& file, int deltaPercent)
+  {
+    size_t baseSize = 0;
+    uint8_t* base = deltaPercent ? static_cast<uint8_t*>(Platform::mapFile(file, baseSize)) : nullptr;
+    int64_t baseTime = base ? Platform::modificationTime(file) : 0;
+    size_t maxPages = (baseSize + StateDelta::PAGE_SIZE - 1) / StateDelta::PAGE_SIZE * deltaPercent / 100;
+    std::vector<StateDelta::Page> pages;
+
+    path_t temporary = file + ".tmp";
+    FILE* fp = nullptr;
+    bool ok = true;
+    size_t offset = 0;
+
+    const uint8_t* data;
+    size_t size;
+    while (ok && pipe.next(data, size))
+    {
+      if (base && !fp)
+      {
+        /// ------ Keep the pages which changed ------
+        for (size_t at = 0; at < size; at += StateDelta::PAGE_SIZE)
+        {
+          size_t length = MIN(StateDelta::PAGE_SIZE, size - at);
+          if (offset + at + length > baseSize || memcmp(base + offset + at, data + at, length))
+          {
+            pages.emplace_back();
+            StateDelta::encode(pages.back(), (uint32_t)((offset + at) / StateDelta::PAGE_SIZE), data + at, length);
+          }
+        }
+
+        /// ------ Too many of them: consolidate into a new base ------
+        if (pages.size() > maxPages)
+        {
+          MENU_DEBUG_PRINTF("Consolidate save state %s\n", file.c_str());
+          fp = fopen(temporary.c_str(), "wb");
+          ok = fp && writeMerged(fp, base, baseSize, pages, offset + size);
+          pages.clear();
+        }
+      }
+      else
+      {
+        if (!fp)
+          fp = fopen(temporary.c_str(), "wb");
+        ok = fp && fwrite(data, 1, size, fp) == size;
+      }
+
+      offset += size;
+      pipe.release();
+    }
+
+    /* the host may have given up serializing halfway */
+    ok = ok && !pipe.hasFailed();
+    if (!ok)
+      pipe.fail();
+
+    /// ------ A delta only fits a base of the same size ------
+    bool delta = ok && base && !fp && offset == baseSize;
+    if (ok && base && !fp && !delta)
+    {
+      fp = fopen(temporary.c_str(), "wb");
+      ok = fp && writeMerged(fp, base, baseSize, pages, offset);
+    }
+    if (base)
+      Platform::unmapFile(base, baseSize);
+
+    if (delta)
+    {
+      MENU_DEBUG_PRINTF("Save state %s delta: %u pages\n", file.c_str(), (unsigned)pages.size());
+      return StateDelta::write(StateDelta::pathFor(file), baseSize, baseTime, pages);
+    }
+
+    if (fp)
+    {
+      ok = Platform::syncFile(fp) && ok;
+      ok = fclose(fp) == 0 && ok;
+    }
+
+    /// ------ Delta goes first, it must never be applied to the new base ------
+    if (ok)
+      ok = (remove(StateDelta::pathFor(file).c_str()) == 0 || !Platform::modificationTime(StateDelta::pathFor(file))) &&
+        Platform::replaceFile(temporary, file);
+    if (!ok) {
+      MENU_ERROR_PRINTF("ERROR Could not write save state %s\n", file.c_str());
+      remove(temporary.c_str());
+    }
+    return ok;
+  }
+
+  /* worker side of a load: fills the pipe from the state file, with its delta applied, until the host stops reading */
+  static bool readState(ChunkPipe& pipe, const path_t& file)
+  {
+    FILE* fp = fopen(file.c_str(), "rb");
+    if (!fp) {
+      MENU_ERROR_PRINTF("ERROR Could not open save state %s\n", file.c_str());
+      pipe.fail();
+      return false;
+    }
+
+    size_t baseSize = 0;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+      long length = ftell(fp);
+      baseSize = length > 0 ? (size_t)length : 0;
+    }
+    fseek(fp, 0, SEEK_SET);
+
+    /// ------ Delta left by the last quick saves, if it still matches ------
+    StateDelta delta;
+    size_t deltaSize = 0;
+    uint8_t* deltaData = static_cast<uint8_t*>(Platform::mapFile(StateDelta::pathFor(file), deltaSize));
+    if (deltaData && !delta.open(deltaData, deltaSize, baseSize, Platform::modificationTime(file))) {
+      MENU_DEBUG_PRINTF("Save state delta of %s is stale\n", file.c_str());
+      Platform::unmapFile(deltaData, deltaSize);
+      deltaData = nullptr;
+    }
+
+    bool ok = true;
+    uint8_t* chunk;
+    size_t offset = 0;
+    bool last = false;
+    while (ok && !last && (chunk = pipe.acquire()) != nullptr)
+    {
+      size_t size = fread(chunk, 1, ChunkPipe::CHUNK_SIZE, fp);
+      last = size < ChunkPipe::CHUNK_SIZE;
+      ok = !deltaData || delta.apply(chunk, offset, size);
+      if (ok)
+        pipe.commit(size, last);
+      else
+        pipe.fail();
+      offset += size;
+    }
+
+    ok = ok && !ferror(fp);
+    fclose(fp);
+    if (deltaData)
+      Platform::unmapFile(deltaData, deltaSize);
+    return ok;
+  }
+
+  /* box filtered down to THUMBNAIL_SIZE, whatever the format of the screen */
+  static void makeThumbnail(SDL_Surface* screen, uint16_t* thumbnail)
+  {
+    const SDL_PixelFormat* format = screen->format;
+    int bytesPerPixel = format->BytesPerPixel;
+    int stepX = MAX(screen->w / THUMBNAIL_SIZE, 1);
+    int stepY = MAX(screen->h / THUMBNAIL_SIZE, 1);
+
+    SDL_LockSurface(screen);
+    for (int ty = 0; ty < THUMBNAIL_SIZE; ty++)
+    {
+      for (int tx = 0; tx < THUMBNAIL_SIZE; tx++)
+      {
+        uint32_t r = 0, g = 0, b = 0, count = 0;
+        for (int y = ty * stepY; y < MIN((ty + 1) * stepY, screen->h); y++)
+        {
+          const uint8_t* row = static_cast<const uint8_t*>(screen->pixels) + y * screen->pitch;
+          for (int x = tx * stepX; x < MIN((tx + 1) * stepX, screen->w); x++)
+          {
+            const uint8_t* p = row + x * bytesPerPixel;
+            Uint32 pixel = bytesPerPixel == 2 ? *reinterpret_cast<const Uint16*>(p) :
+              bytesPerPixel == 4 ? *reinterpret_cast<const Uint32*>(p) :
+              bytesPerPixel == 3 ? (p[0] | p[1] << 8 | p[2] << 16) : *p;
+
+            Uint8 pr, pg, pb;
+            SDL_GetRGB(pixel, format, &pr, &pg, &pb);
+            r += pr;
+            g += pg;
+            b += pb;
+            count++;
+          }
+        }
+
+        if (count) {
+          r /= count;
+          g /= count;
+          b /= count;
+        }
+        thumbnail[ty * THUMBNAIL_SIZE + tx] = (uint16_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+      }
+    }
+    SDL_UnlockSurface(screen);
+  }
+
+public:
+  SaveStateService() : callbacks{ nullptr, nullptr, nullptr }, deltaPercent(0), revision(0)
+  {
+    thumbnails.fill(nullptr);
+    thumbnailRevision.fill(0);
+  }
+  ~SaveStateService() { releaseThumbnails(); }
+
+  bool isEnabled() const { return callbacks.serialize && callbacks.deserialize && !path.empty(); }
+
+  /* pending saves must have landed, nothing else is written to the previous path */
+  void setup(const path_t& path, const FK_SaveStateCallbacks* callbacks)
+  {
+    this->path = path;
+    this->callbacks = callbacks ? *callbacks : FK_SaveStateCallbacks{ nullptr, nullptr, nullptr };
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (isEnabled())
+      loadIndex();
+    revision++;
+  }
+
+  /* 0 writes every save in full, otherwise on top of a base until more than percent of its pages changed */
+  void setDeltas(int percent) { deltaPercent = MAX(0, MIN(percent, 100)); }
+
+  uint32_t getRevision()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return revision;
+  }
+
+  /* date of a slot, 0 if empty, and its thumbnail if it has one, valid until the next call for that slot */
+  SDL_Surface* preview(int slot, int64_t& time)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const Slot& entry = slots[slot];
+    time = entry.time;
+    if (!entry.time || !entry.hasThumbnail)
+      return nullptr;
+
+    if (!thumbnails[slot] || thumbnailRevision[slot] != revision)
+    {
+      if (!thumbnails[slot])
+        thumbnails[slot] = SDL_CreateRGBSurface(SDL_SWSURFACE, THUMBNAIL_SIZE, THUMBNAIL_SIZE, 16, 0xF800, 0x07E0, 0x001F, 0);
+      if (!thumbnails[slot])
+        return nullptr;
+
+      SDL_Surface* surface = thumbnails[slot];
+      SDL_LockSurface(surface);
+      for (int y = 0; y < THUMBNAIL_SIZE; y++)
+        memcpy(static_cast<uint8_t*>(surface->pixels) + y * surface->pitch, entry.thumbnail + y * THUMBNAIL_SIZE, THUMBNAIL_SIZE * 2);
+      SDL_UnlockSurface(surface);
+      thumbnailRevision[slot] = revision;
+    }
+    return thumbnails[slot];
+  }
+
+  void releaseThumbnails()
+  {
+    for (SDL_Surface*& surface : thumbnails)
+    {
+      SDL_FreeSurface(surface);
+      surface = nullptr;
+    }
+  }
+
+  /* serializes the state on the calling thread while the worker streams it to disk, true once the host wrote it
+     all. The file and the index are only updated if it also reached the disk */
+  bool save(CommandWorker& commands, int slot, SDL_Surface* screen)
+  {
+    std::shared_ptr<ChunkPipe> pipe = std::make_shared<ChunkPipe>();
+    std::shared_ptr<Slot> entry = std::make_shared<Slot>();
+    entry->time = (int64_t)::time(nullptr);
+    entry->hasThumbnail = screen != nullptr && slot != QUICK_SLOT;
+    if (entry->hasThumbnail)
+      makeThumbnail(screen, entry->thumbnail);
+
+    path_t file = statePath(slot);
+    MENU_DEBUG_PRINTF("Save state %s\n", file.c_str());
+
+    /* no key: a save is never replaced by the next one */
+    int deltaPercent = this->deltaPercent;
+    commands.post("", [this, pipe, entry, slot, file, deltaPercent] {
+      if (!writeState(*pipe, file, deltaPercent))
+        return -1;
+      if (slot == QUICK_SLOT)
+        return 0;
+
+      std::array<Slot, MAX_SAVE_SLOTS> copy;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        slots[slot] = *entry;
+        revision++;
+        copy = slots;
+      }
+      return saveIndex(copy) ? 0 : -1;
+    });
+
+    FK_SaveStream stream(*pipe);
+    bool ok = callbacks.serialize(&stream, callbacks.userdata) == 0 && stream.ok;
+    stream.closeWrite(ok);
+    if (!ok)
+      MENU_ERROR_PRINTF("ERROR Could not serialize save state for slot %d\n", slot + 1);
+    return ok;
+  }
+
+  /* streams the state from disk on the worker while the host deserializes it on the calling thread */
+  bool load(CommandWorker& commands, int slot)
+  {
+    path_t file = statePath(slot);
+    if (!Platform::modificationTime(file)) {
+      MENU_ERROR_PRINTF("ERROR No save state in slot %d\n", slot + 1);
+      return false;
+    }
+
+    MENU_DEBUG_PRINTF("Load state %s\n", file.c_str());
+    std::shared_ptr<ChunkPipe> pipe = std::make_shared<ChunkPipe>();
+    CommandWorker::ticket_t ticket = commands.post("", [pipe, file] { return readState(*pipe, file) ? 0 : -1; });
+
+    FK_SaveStream stream(*pipe);
+    bool ok = callbacks.deserialize(&stream, callbacks.userdata) == 0;
+    stream.closeRead();
+    ok = commands.wait(ticket) == 0 && ok;
+    if (!ok)
+      MENU_ERROR_PRINTF("ERROR Could not load save state %s\n", file.c_str());
+    return ok;
+  }
+};
+
+/* LRU cache of rendered text surfaces, keyed on font, text and color, in a fixed number of slots.
+   Texts drawn every frame are rendered once and then cost no allocation */
+class TextCache
+{
+public:
+  static constexpr size_t CAPACITY = 32;
+  static constexpr size_t MAX_TEXT_LENGTH = 63;
+
+private:
+  /* keys are kept inline so that looking a text up costs no allocation */
+  struct Slot
+  {
+    TTF_Font* font;
+    Uint32 color;
+    uint32_t hash;
+    uint32_t lastUse;
+    char text[MAX_TEXT_LENGTH + 1];
+    SDL_Surface* surface;
+  };
+
+  std::array<Slot, CAPACITY> slots;
+  SDL_Surface* uncached;    /* last text too long for a key, replaced by the next one */
+  uint32_t useCount;
+  bool displayFormat;
+
+  static uint32_t hashText(const char* text)
+  {
+    uint32_t hash = 2166136261u;
+    for (; *text; ++text)
+      hash = (hash ^ (uint8_t)*text) * 16777619u;
+    return hash;
+  }
+
+  SDL_Surface* render(TTF_Font* font, const char* text, SDL_Color color)
+  {
+    SDL_Surface* surface = renderText(font, text, color);
+    if (!surface)
+    {
+      MENU_ERROR_PRINTF("ERROR TTF_RenderText_Blended: %s\n", TTF_GetError());
+      return nullptr;
+    }
+
+    /* convert once so that every following blit is a fast one */
+    return displayFormat ? toDisplayFormat(surface, true) : surface;
+  }
+
+public:
+  TextCache() : uncached(nullptr), useCount(0), displayFormat(true)
+  {
+    for (Slot& slot : slots)
+      slot.surface = nullptr;
+  }
+  ~TextCache() { clear(); }
+
+  /* surfaces are left in software format while disabled, display format must only be touched by the video thread */
+  void setDisplayFormat(bool enabled) { displayFormat = enabled; }
+
+  /* returns a surface owned by the cache, valid until next call to get() or clear() */
+  SDL_Surface* get(TTF_Font* font, const char* text, SDL_Color color)
+  {
+    if (strlen(text) > MAX_TEXT_LENGTH)
+    {
+      SDL_FreeSurface(uncached);
+      uncached = render(font, text, color);
+      return uncached;
+    }
+
+    Uint32 rgb = (Uint32)((color.r << 16) | (color.g << 8) | color.b);
+    uint32_t hash = hashText(text);
+
+    /* hit, or else the least recently used slot which an empty one always is */
+    Slot* victim = &slots[0];
+    for (Slot& slot : slots)
+    {
+      if (slot.surface && slot.hash == hash && slot.font == font && slot.color == rgb && !strcmp(slot.text, text))
+      {
+        slot.lastUse = ++useCount;
+        return slot.surface;
+      }
+      if (!slot.surface ? victim->surface != nullptr : (victim->surface && slot.lastUse < victim->lastUse))
+        victim = &slot;
+    }
+
+    SDL_Surface* surface = render(font, text, color);
+    if (!surface)
+      return nullptr;
+
+    SDL_FreeSurface(victim->surface);
+    victim->font = font;
+    victim->color = rgb;
+    victim->hash = hash;
+    victim->lastUse = ++useCount;
+    strcpy(victim->text, text);
+    victim->surface = surface;
+    return surface;
+  }
+
+  void clear()
+  {
+    for (Slot& slot : slots)
+    {
+      SDL_FreeSurface(slot.surface);
+      slot.surface = nullptr;
+    }
+    SDL_FreeSurface(uncached);
+    uncached = nullptr;
+  }
+};
+
+/* paces frames at a target rate, deadlines are computed from the start of the sequence so that
+   the integer ms rounding of each frame never accumulates into drift */
+class FramePacer
+{
+private:
+  int fps;
+  Uint32 start;
+  Uint32 frames;
+
+public:
+  FramePacer(int fps) : fps(fps), start(0), frames(0) { }
+
+  /* a rate <= 0 disables pacing */
+  void setFps(int fps) { this->fps = fps; reset(); }
+  int getFps() const { return fps; }
+
+  void reset() { frames = 0; }
+
+  void wait()
+  {
+    if (fps <= 0)
+      return;
+
+    /* first frame after a reset goes out right away */
+    if (frames++ == 0)
+    {
+      start = SDL_GetTicks();
+      return;
+    }
+
+    Uint32 deadline = start + (Uint32)((uint64_t)(frames - 1) * 1000 / fps);
+    Uint32 now = SDL_GetTicks();
+
+    if ((Sint32)(deadline - now) > 0)
+      SDL_Delay(deadline - now);
+    /* too late to catch up, start over instead of rushing the next frames */
+    else if (now - deadline > (Uint32)(1000 / fps))
+      reset();
+  }
+};
+
+/* drains the SDL event queue once per frame into the actions the menu runs. Consecutive LEFT and RIGHT presses,
+   e.g. a key repeat burst, are merged into one net step and an UP or DOWN pressed while scrolling is kept
+   for when the scroll is over */
+class MenuInput
+{
+public:
+  enum ActionType { ACTION_QUIT, ACTION_CLOSE, ACTION_BACK, ACTION_MOVE, ACTION_ZONE };
+
+  struct Action
+  {
+    ActionType type;
+    SDLKey key;     /* ACTION_ZONE: SDLK_LEFT, SDLK_RIGHT or SDLK_RETURN */
+    int value;      /* ACTION_MOVE: +1 down, -1 up. ACTION_ZONE: how many times key was pressed */
+  };
+
+private:
+  std::vector<Action> actions;
+  int pendingMove;
+
+  void push(ActionType type, SDLKey key, int value)
+  {
+    actions.push_back({ type, key, value });
+  }
+
+  /* LEFT and RIGHT cancel each other, the net step replaces the last action if it is one too */
+  void pushStep(int step)
+  {
+    if (!actions.empty() && actions.back().type == ACTION_ZONE && actions.back().key != SDLK_RETURN)
+    {
+      Action& last = actions.back();
+      int net = (last.key == SDLK_RIGHT ? last.value : -last.value) + step;
+      if (!net)
+        actions.pop_back();
+      else
+      {
+        last.key = net > 0 ? SDLK_RIGHT : SDLK_LEFT;
+        last.value = net > 0 ? net : -net;
+      }
+      return;
+    }
+    push(ACTION_ZONE, step > 0 ? SDLK_RIGHT : SDLK_LEFT, 1);
+  }
+
+public:
+  MenuInput() : pendingMove(0) { }
+
+  /* letters are the names of the console keys */
+  static SDLKey translate(SDLKey key)
+  {
+    switch (key)
+    {
+    case SDLK_l: return SDLK_LEFT;
+    case SDLK_r: return SDLK_RIGHT;
+    case SDLK_a: return SDLK_RETURN;
+    case SDLK_u: return SDLK_UP;
+    case SDLK_d: return SDLK_DOWN;
+    case SDLK_q: return SDLK_ESCAPE;
+    default: return key;
+    }
+  }
+
+  void reset()
+  {
+    actions.clear();
+    pendingMove = 0;
+  }
+
+  /* moves the menu after the ongoing scroll, used for moves which come in once one has started */
+  void deferMove(int direction) { pendingMove = direction; }
+  bool hasPendingMove() const { return pendingMove != 0; }
+
+  /* returns the actions of this frame in order. While scrolling only the latest move is kept and zone keys
+     are dropped, since they would land on a zone which is not shown yet */
+  const std::vector<Action>& poll(bool scrolling)
+  {
+    actions.clear();
+    if (!scrolling && pendingMove)
+    {
+      push(ACTION_MOVE, SDLK_UNKNOWN, pendingMove);
+      pendingMove = 0;
+    }
+
+    SDL_Event event;
+    while (SDL_PollEvent(&event))
+    {
+      if (event.type == SDL_QUIT)
+      {
+        push(ACTION_QUIT, SDLK_UNKNOWN, 0);
+        continue;
+      }
+      if (event.type != SDL_KEYDOWN)
+        continue;
+
+      SDLKey key = translate(event.key.keysym.sym);
+      switch (key)
+      {
+      case SDLK_ESCAPE:
+        push(ACTION_CLOSE, key, 0);
+        break;
+      case SDLK_b:
+        push(ACTION_BACK, key, 0);
+        break;
+      case SDLK_UP:
+      case SDLK_DOWN:
+        if (scrolling)
+          pendingMove = key == SDLK_DOWN ? 1 : -1;
+        else
+          push(ACTION_MOVE, key, key == SDLK_DOWN ? 1 : -1);
+        break;
+      case SDLK_LEFT:
+      case SDLK_RIGHT:
+        if (!scrolling)
+          pushStep(key == SDLK_RIGHT ? 1 : -1);
+        break;
+      case SDLK_RETURN:
+        if (!scrolling)
+          push(ACTION_ZONE, key, 1);
+        break;
+      default:
+        break;
+      }
+    }
+
+    return actions;
+  }
+};
+
+/* collects the screen areas which need to be repainted on next frame */
+class DamageTracker
+{
+private:
+  static constexpr size_t MAX_RECTS = 8;
+
+  std::array<SDL_Rect, MAX_RECTS> rects;
+  size_t count;
+  bool full;
+
+public:
+  DamageTracker() : count(0), full(true) { }
+
+  void add(const SDL_Rect& rect)
+  {
+    if (full || rect.w == 0 || rect.h == 0)
+      return;
+    else if (count == MAX_RECTS)
+      full = true;
+    else
+      rects[count++] = rect;
+  }
+
+  void all() { full = true; }
+  void clear() { count = 0; full = false; }
+
+  bool isFull() const { return full; }
+  bool isEmpty() const { return !full && count == 0; }
+
+  size_t size() const { return count; }
+  SDL_Rect* data() { return rects.data(); }
+};
+
+/* pushes painted frames to the display: a double buffered hardware screen is page flipped, any other only gets
+   its damaged areas copied. A flipped buffer still holds the frame before last, so what changed on the previous
+   frame is repainted on it too */
+class FramePresenter
+{
+private:
+  DamageTracker previous;
+  bool previousValid;
+
+public:
+  FramePresenter() : previousValid(false) { }
+
+  static bool pageFlips(const SDL_Surface* screen)
+  {
+    return (screen->flags & (SDL_HWSURFACE | SDL_DOUBLEBUF)) == (SDL_HWSURFACE | SDL_DOUBLEBUF);
+  }
+
+  /* extends damage to what the buffer about to be painted misses, to be called once per frame before painting */
+  void age(const SDL_Surface* screen, DamageTracker& damage)
+  {
+    if (!pageFlips(screen) || damage.isEmpty())
+      return;
+
+    DamageTracker current = damage;
+    if (!previousValid || previous.isFull())
+      damage.all();
+    else
+      for (size_t i = 0; i < previous.size(); ++i)
+        damage.add(previous.data()[i]);
+
+    previous = current;
+    previousValid = true;
+  }
+
+  void present(SDL_Surface* screen, DamageTracker& damage)
+  {
+    if (damage.isEmpty())
+      return;
+    else if (pageFlips(screen))
+      SDL_Flip(screen);
+    else if (damage.isFull())
+      SDL_UpdateRect(screen, 0, 0, 0, 0);
+    else
+      SDL_UpdateRects(screen, (int)damage.size(), damage.data());
+  }
+
+  /* buffers content is unknown, e.g. the host drew on the screen */
+  void invalidate() { previousValid = false; }
+};
+
+/* outgoing and incoming zones composed once and stacked vertically with their transparency kept, so that each
+   frame of a scroll animation is the static background plus a single blit of a screen-sized window */
+class ScrollStrip
+{
+private:
+  SDL_Surface* surface;
+  int from, to, direction;
+  bool valid;
+
+public:
+  ScrollStrip() : surface(nullptr), from(0), to(0), direction(0), valid(false) { }
+  ~ScrollStrip() { release(); }
+
+  /* raw copy, alpha channel included */
+  static void copy(SDL_Surface* zone, SDL_Surface* dest, SDL_Rect* pos)
+  {
+    Uint32 flags = zone->flags & (SDL_SRCALPHA | SDL_RLEACCEL);
+    Uint8 alpha = zone->format->alpha;
+    SDL_SetAlpha(zone, 0, alpha);
+    blitSurface(zone, NULL, dest, pos);
+    SDL_SetAlpha(zone, flags, alpha);
+  }
+
+  bool prepare(SDL_Surface* screen, SDL_Surface* fromZone, SDL_Surface* toZone, int from, int to, int direction)
+  {
+    if (!fromZone || !toZone)
+      return false;
+
+    if (valid && this->from == from && this->to == to && this->direction == direction)
+      return true;
+
+    valid = false;
+
+    /* kept between scrolls in the zones format, only reallocated if the screen or the zones change */
+    const SDL_PixelFormat* format = toZone->format;
+    if (surface && (surface->w != screen->w || surface->h != screen->h * 2 || surface->format->BitsPerPixel != format->BitsPerPixel ||
+      surface->format->Amask != format->Amask))
+      release();
+
+    if (!surface)
+    {
+      surface = SDL_CreateRGBSurface(SDL_SWSURFACE, screen->w, screen->h * 2, format->BitsPerPixel,
+        format->Rmask, format->Gmask, format->Bmask, format->Amask);
+      if (!surface)
+      {
+        MENU_ERROR_PRINTF("ERROR Could not create scroll strip: %s\n", SDL_GetError());
+        return false;
+      }
+      SDL_SetAlpha(surface, format->Amask ? SDL_SRCALPHA : 0, SDL_ALPHA_OPAQUE);
+    }
+    else
+      SDL_FillRect(surface, NULL, 0);
+
+    /* scrolling down brings the next zone from below, scrolling up from above */
+    SDL_Surface* top = direction > 0 ? fromZone : toZone;
+    SDL_Surface* bottom = direction > 0 ? toZone : fromZone;
+
+    SDL_Rect topPos = { 0, 0, 0, 0 };
+    SDL_Rect bottomPos = { 0, (Sint16)screen->h, 0, 0 };
+
+    copy(top, surface, &topPos);
+    copy(bottom, surface, &bottomPos);
+
+    this->from = from;
+    this->to = to;
+    this->direction = direction;
+    valid = true;
+    return true;
+  }
+
+  /* the background stays still under the scrolling zones */
+  int blit(SDL_Surface* screen, SDL_Surface* background, int scroll)
+  {
+    if (blitSurface(background, NULL, screen, NULL))
+      return -1;
+    SDL_Rect window = { 0, (Sint16)(scroll > 0 ? scroll : screen->h + scroll), (Uint16)screen->w, (Uint16)screen->h };
+    return blitSurface(surface, &window, screen, NULL);
+  }
+
+  void invalidate() { valid = false; }
+
+  void release()
+  {
+    SDL_FreeSurface(surface);
+    surface = nullptr;
+    valid = false;
+  }
+};
+
+#ifdef HAS_MENU_ASPECT_RATIO
+/* what the game would look like in each aspect ratio, shown behind the aspect ratio zone. The source frame is
+   copied once as RGB565, halved while more than twice the screen size, and each mode is scaled only the first
+   time it is shown, so cycling through them costs one blit */
+class AspectPreview
+{
+private:
+  struct Output
+  {
+    int factor;
+    SDL_Surface* surface;
+  };
+
+  SDL_Surface* frame;       /* given by the host or the menu background, copied on first use */
+  SDL_Surface* source;
+  FK_Scaler* scaler;
+  std::array<Output, NB_ASPECT_RATIOS_TYPES> outputs;
+
+  /* 2x2 box filter */
+  static SDL_Surface* halve(SDL_Surface* surface)
+  {
+    SDL_Surface* half = SDL_CreateRGBSurface(SDL_SWSURFACE, surface->w / 2, surface->h / 2, 16, 0xF800, 0x07E0, 0x001F, 0);
+    if (!half)
+      return nullptr;
+
+    SDL_LockSurface(surface);
+    SDL_LockSurface(half);
+    for (int y = 0; y < half->h; y++)
+    {
+      const uint16_t* top = reinterpret_cast<const uint16_t*>(static_cast<const uint8_t*>(surface->pixels) + 2 * y * surface->pitch);
+      const uint16_t* bottom = reinterpret_cast<const uint16_t*>(reinterpret_cast<const uint8_t*>(top) + surface->pitch);
+      uint16_t* dest = reinterpret_cast<uint16_t*>(static_cast<uint8_t*>(half->pixels) + y * half->pitch);
+      for (int x = 0; x < half->w; x++)
+      {
+        uint32_t sum = 0;
+        const uint16_t pixels[4] = { top[2 * x], top[2 * x + 1], bottom[2 * x], bottom[2 * x + 1] };
+        for (uint16_t pixel : pixels)
+          sum += (pixel | (uint32_t)pixel << 16) & 0x07E0F81F;
+        sum = (sum >> 2) & 0x07E0F81F;
+        dest[x] = (uint16_t)(sum | sum >> 16);
+      }
+    }
+    SDL_UnlockSurface(half);
+    SDL_UnlockSurface(surface);
+    return half;
+  }
+
+  bool prepareSource(SDL_Surface* screen)
+  {
+    if (source)
+      return true;
+    if (!frame)
+      return false;
+
+    source = SDL_CreateRGBSurface(SDL_SWSURFACE, frame->w, frame->h, 16, 0xF800, 0x07E0, 0x001F, 0);
+    if (!source || blitSurface(frame, NULL, source, NULL)) {
+      MENU_ERROR_PRINTF("ERROR Could not copy aspect ratio preview source: %s\n", SDL_GetError());
+      SDL_FreeSurface(source);
+      source = nullptr;
+      return false;
+    }
+
+    while (source->w > 2 * screen->w && source->h > 2 * screen->h)
+    {
+      SDL_Surface* half = halve(source);
+      if (!half)
+        break;
+      SDL_FreeSurface(source);
+      source = half;
+    }
+
+    scaler = FK_CreateScaler(source->w, source->h, screen->w, screen->h, SCALER_FILTER_NEAREST);
+    return scaler != nullptr;
+  }
+
+public:
+  AspectPreview() : frame(nullptr), source(nullptr), scaler(nullptr) { outputs.fill({ 0, nullptr }); }
+  ~AspectPreview() { release(); }
+
+  /* frame previews are made of from now on, it must stay untouched until release() */
+  void setFrame(SDL_Surface* frame)
+  {
+    release();
+    this->frame = frame;
+  }
+
+  /* screen-sized surface of the frame in mode, nullptr if it cannot be made */
+  SDL_Surface* get(SDL_Surface* screen, int mode, int factor)
+  {
+    if (mode < 0 || mode >= NB_ASPECT_RATIOS_TYPES || !prepareSource(screen))
+      return nullptr;
+
+    Output& output = outputs[mode];
+    if (output.surface && (mode != ASPECT_RATIOS_TYPE_MANUAL || output.factor == factor))
+      return output.surface;
+
+    /* a stale manual zoom was converted to display format, the scaler needs RGB565 again */
+    SDL_FreeSurface(output.surface);
+    output.surface = SDL_CreateRGBSurface(SDL_SWSURFACE, screen->w, screen->h, 16, 0xF800, 0x07E0, 0x001F, 0);
+    if (!output.surface)
+      return nullptr;
+
+    FK_SetScalerMode(scaler, mode, factor);
+    SDL_LockSurface(source);
+    SDL_LockSurface(output.surface);
+    FK_ScaleFrame(scaler, static_cast<const uint16_t*>(source->pixels), source->pitch,
+      static_cast<uint16_t*>(output.surface->pixels), output.surface->pitch);
+    SDL_UnlockSurface(output.surface);
+    SDL_UnlockSurface(source);
+
+    output.surface = toDisplayFormat(output.surface, false);
+    output.factor = factor;
+    return output.surface;
+  }
+
+  void release()
+  {
+    for (Output& output : outputs)
+    {
+      SDL_FreeSurface(output.surface);
+      output.surface = nullptr;
+    }
+    SDL_FreeSurface(source);
+    source = nullptr;
+    FK_FreeScaler(scaler);
+    scaler = nullptr;
+    frame = nullptr;
+  }
+};
+#endif
+
+/* progress bar with its geometry computed once and its two bar states prerendered as tiles,
+   drawing is a same-format copy per bar and a value change only touches bars whose state flipped */
+class ProgressBar
+{
+private:
+  static constexpr uint16_t MAX_BARS = 32;
+  static constexpr uint16_t LINE_WIDTH = 1; //px
+  static constexpr uint16_t PADDING_BARS_RATIO = 3;
+
+  std::array<SDL_Rect, MAX_BARS> bars;
+  uint16_t nb_bars;
+  SDL_Surface* fullTile, *emptyTile;
+
+  static bool sameFormat(const SDL_PixelFormat* a, const SDL_PixelFormat* b)
+  {
+    return a->BitsPerPixel == b->BitsPerPixel && a->Rmask == b->Rmask && a->Gmask == b->Gmask && a->Bmask == b->Bmask && a->Amask == b->Amask;
+  }
+
+  SDL_Surface* createTile(const SDL_PixelFormat* format, bool full)
+  {
+    SDL_Surface* tile = SDL_CreateRGBSurface(SDL_SWSURFACE, bars[0].w, bars[0].h, format->BitsPerPixel,
+      format->Rmask, format->Gmask, format->Bmask, format->Amask);
+    if (!tile)
+    {
+      MENU_ERROR_PRINTF("ERROR Could not create progress bar tile: %s\n", SDL_GetError());
+      return nullptr;
+    }
+
+    /* tiles are opaque, they must overwrite and not blend */
+    SDL_SetAlpha(tile, 0, SDL_ALPHA_OPAQUE);
+    SDL_FillRect(tile, NULL, SDL_MapRGB(tile->format, GRAY_MAIN_R, GRAY_MAIN_G, GRAY_MAIN_B));
+
+    if (!full)
+    {
+      SDL_Rect inner = { LINE_WIDTH, LINE_WIDTH, (Uint16)(tile->w - LINE_WIDTH * 2), (Uint16)(tile->h - LINE_WIDTH * 2) };
+      SDL_FillRect(tile, &inner, SDL_MapRGB(tile->format, WHITE_MAIN_R, WHITE_MAIN_G, WHITE_MAIN_B));
+    }
+
+    return tile;
+  }
+
+  bool prepareTiles(const SDL_PixelFormat* format)
+  {
+    if (fullTile && emptyTile && sameFormat(fullTile->format, format))
+      return true;
+
+    releaseTiles();
+    fullTile = createTile(format, true);
+    emptyTile = createTile(format, false);
+    return fullTile && emptyTile;
+  }
+
+  uint16_t fullBars(int percentage) const
+  {
+    percentage = (percentage > 100) ? 100 : (percentage < 0 ? 0 : percentage);
+    return nb_bars * percentage / 100;
+  }
+
+public:
+  ProgressBar() : nb_bars(0), fullTile(nullptr), emptyTile(nullptr) { }
+  ~ProgressBar() { releaseTiles(); }
+
+  void setup(SDL_Surface* surface, uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint16_t nb_bars)
+  {
+    /// ------ Check values ------
+    x = (x > (surface->w - 1)) ? (surface->w - 1) : x;
+    y = (y > surface->h - 1) ? (surface->h - 1) : y;
+    width = (width < LINE_WIDTH * 2 + 1) ? (LINE_WIDTH * 2 + 1) : width;
+    width = (width > surface->w - x - 1) ? (surface->w - x - 1) : width;
+    height = (height < LINE_WIDTH * 2 + 1) ? (LINE_WIDTH * 2 + 1) : height;
+    height = (height > surface->h - y - 1) ? (surface->h - y - 1) : height;
+    uint16_t nb_bars_max = (width * PADDING_BARS_RATIO / (LINE_WIDTH * 2 + 1) + 1) / (PADDING_BARS_RATIO + 1);
+    nb_bars = (nb_bars > nb_bars_max) ? nb_bars_max : nb_bars;
+    nb_bars = (nb_bars > MAX_BARS) ? MAX_BARS : nb_bars;
+    uint16_t bar_width = (width / nb_bars) * PADDING_BARS_RATIO / (PADDING_BARS_RATIO + 1) + 1;
+    uint16_t bar_padding_x = bar_width / PADDING_BARS_RATIO;
+
+    /// ------ Compute bars geometry ------
+    this->nb_bars = nb_bars;
+    for (int i = 0; i < nb_bars; ++i)
+    {
+      SDL_Rect rect = { (Sint16)(x + i * (bar_width + bar_padding_x)), (Sint16)y, bar_width, height };
+      bars[i] = rect;
+    }
+
+    releaseTiles();
+  }
+
+  void draw(SDL_Surface* surface, int percentage)
+  {
+    if (!nb_bars || !prepareTiles(surface->format))
+      return;
+
+    uint16_t nb_full_bars = fullBars(percentage);
+    for (int i = 0; i < nb_bars; ++i)
+    {
+      SDL_Rect pos = bars[i];
+      blitSurface(i < nb_full_bars ? fullTile : emptyTile, NULL, surface, &pos);
+    }
+  }
+
+  /* area covering the bars which differ between the two values */
+  SDL_Rect changedRect(int oldPercentage, int newPercentage) const
+  {
+    uint16_t oldBars = fullBars(oldPercentage), newBars = fullBars(newPercentage);
+    uint16_t first = MIN(oldBars, newBars), last = MAX(oldBars, newBars);
+
+    if (!nb_bars || first == last)
+    {
+      SDL_Rect none = { 0, 0, 0, 0 };
+      return none;
+    }
+
+    SDL_Rect rect = bars[first];
+    rect.w = bars[last - 1].x + bars[last - 1].w - rect.x;
+    return rect;
+  }
+
+  void releaseTiles()
+  {
+    SDL_FreeSurface(fullTile);
+    SDL_FreeSurface(emptyTile);
+    fullTile = emptyTile = nullptr;
+  }
+};
+
+/// -------------- CONSTANTS --------------
+static const SDL_Color text_color = { GRAY_MAIN_R, GRAY_MAIN_G, GRAY_MAIN_B };
+
+#ifdef HAS_MENU_ASPECT_RATIO
+#undef X
+#define X(a, b) b,
+static const char* aspect_ratio_name[] = { ASPECT_RATIOS };
+#endif
+
+/* values the menu screen is drawn from, compared between frames to find what changed */
+struct MenuRenderState
+{
+  SDL_Surface* screen, *background;
+  int menuItem, prevItem, scroll;
+  int confirmation, action;
+  int bar;
+  int slot, option, toggle;
+  uint32_t revision;
+
+  bool sameZone(const MenuRenderState& o) const { return screen == o.screen && background == o.background && menuItem == o.menuItem && prevItem == o.prevItem && scroll == o.scroll; }
+  bool sameBar(const MenuRenderState& o) const { return bar == o.bar; }
+  bool sameInfo(const MenuRenderState& o) const { return confirmation == o.confirmation && action == o.action && slot == o.slot && option == o.option && toggle == o.toggle && revision == o.revision; }
+};
+
+/* a zone of the menu: its surface, composed once, and the callbacks giving it a behavior */
+class FunKeyMenuEntry
+{
+public:
+  using compose_t = std::function<void(SDL_Surface* surface)>;
+  using render_t = std::function<void(SDL_Surface* screen, uint8_t confirmation, uint8_t action)>;
+  using key_t = std::function<int(SDLKey key, uint8_t confirmation)>;
+  using step_t = std::function<int(int delta)>;
+
+  int type;                 /* ENUM_MENU_TYPE, NB_MENU_TYPES for zones added by the host */
+  SDL_Surface* surface;
+  std::string caption;
+  int captionLine;          /* in lines from the zone center */
+  compose_t compose;        /* static content drawn once on the surface, after the caption */
+  render_t render;          /* content drawn over the surface while the zone is shown */
+  key_t onKey;              /* gets SDLK_LEFT, SDLK_RIGHT or SDLK_RETURN, returns ENUM_MENU_ZONE_RESULT flags */
+  step_t onStep;            /* if set, gets a burst of SDLK_LEFT and SDLK_RIGHT at once as a net delta, RIGHT positive */
+  bool showsAction;         /* painted in its action state before a confirmed SDLK_RETURN is handled */
+  ProgressBar* bar;         /* drawn with *barValue, its geometry is set up by the menu */
+  const int* barValue;
+  uint16_t barSteps;
+  uint32_t revision;        /* host zones keep their state to themselves, this tells when it changed */
+
+  FunKeyMenuEntry(int type, const std::string& caption, int captionLine) : type(type), surface(nullptr), caption(caption),
+    captionLine(captionLine), showsAction(false), bar(nullptr), barValue(nullptr), barSteps(0), revision(0) { }
+
+  bool isCustom() const { return type == NB_MENU_TYPES; }
+};
+
+/* vector-like storage of a capacity fixed at compile time, elements are built in place and never move */
+template<typename T, size_t N>
+class FixedArray
+{
+private:
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type storage[N];
+  size_t count;
+
+public:
+  FixedArray() : count(0) { }
+  ~FixedArray() { clear(); }
+  FixedArray(const FixedArray&) = delete;
+  FixedArray& operator=(const FixedArray&) = delete;
+
+  /* the array must not be full */
+  template<typename... Args> T& emplace_back(Args&&... args)
+  {
+    T* element = new (&storage[count]) T(std::forward<Args>(args)...);
+    ++count;
+    return *element;
+  }
+
+  void clear()
+  {
+    while (count)
+      reinterpret_cast<T*>(&storage[--count])->~T();
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return !count; }
+  bool full() const { return count == N; }
+
+  T& operator[](size_t i) { return reinterpret_cast<T*>(storage)[i]; }
+  const T& operator[](size_t i) const { return reinterpret_cast<const T*>(storage)[i]; }
+  T& back() { return (*this)[count - 1]; }
+
+  T* begin() { return reinterpret_cast<T*>(storage); }
+  T* end() { return begin() + count; }
+  const T* begin() const { return reinterpret_cast<const T*>(storage); }
+  const T* end() const { return begin() + count; }
+};
+
+class FunKeyMenu
+{
+private:
+  /* TTF is shared by all menus, it is only shut down by the last one if none of them found it running */
+  static bool wasTTFInit;
+  static int ttfUsers;
+
+  FixedArray<FunKeyMenuEntry, MENU_BUILTIN_ZONES + MAX_CUSTOM_MENU_ZONES> zones;
+
+  /* zones added by the host, registered again after the built-in ones on each init */
+  struct CustomZone
+  {
+    FK_MenuZone desc;
+    std::string caption;    /* desc.caption may not outlive FK_AddMenuZone */
+
+    CustomZone(const FK_MenuZone& desc) : desc(desc), caption(desc.caption ? desc.caption : "") { }
+  };
+  FixedArray<CustomZone, MAX_CUSTOM_MENU_ZONES> customZones;
+
+  static constexpr int MENU_EVENT_WAKEUP = 0x464B;
+  static constexpr int DEFAULT_FPS = 60;
+  static constexpr Uint32 OVERLAY_TIMEOUT_MS = 2000;
+  static constexpr int OVERLAY_ALPHA = 224;
+
+  TextCache textCache;
+  ResourceBundle bundle;
+  ZoneCache zoneCache;
+  SaveStateService saves;
+  SystemState systemState;
+
+  /// -------------- MENU STATE --------------
+  int initCount = 0;
+  CommandWorker::ticket_t preloadTicket = 0;
+  CommandWorker::ticket_t systemStateTicket = 0;
+  bool deferDisplayFormat = false;
+  int zoneBudget = 0;
+  int builtZones = 0;
+  SDL_Surface* background_screen = NULL;
+  int backup_key_repeat_delay = 0;
+  int backup_key_repeat_interval = 0;
+  int menuItem = 0;
+  int stop_menu_loop = 0;
+  std::atomic<bool> loopRunning{ false };
+  uint8_t menu_confirmation = 0;
+
+#ifdef HAS_MENU_VOLUME
+  int volume_percentage = 0;
+  int initial_volume_percentage = 0;
+  ProgressBar volume_bar;
+#endif
+#ifdef HAS_MENU_BRIGHTNESS
+  int brightness_percentage = 0;
+  int initial_brightness_percentage = 0;
+  ProgressBar brightness_bar;
+#endif
+
+#ifdef HAS_MENU_ASPECT_RATIO
+  int aspect_ratio = ASPECT_RATIOS_TYPE_STRECHED;
+  int aspect_ratio_factor_percent = 50;
+  int aspect_ratio_factor_step = 10;
+  AspectPreview aspectPreview;
+#endif
+
+#ifdef HAS_MENU_THEME
+  Configuration* config = NULL;
+  int indexChooseLayout = 0;
+#endif
+
+#if defined(HAS_MENU_SAVE) || defined (HAS_MENU_LOAD)
+  int savestate_slot = 0;
+  uint8_t savestate_failed = 0;
+#endif
+
+#ifdef HAS_MENU_USB
+  /// USB stuff
+  int usb_data_connected = 0;
+  int usb_sharing = 0;
+#endif
+
+#ifdef HAS_MENU_RO_RW
+  int read_write = 0;
+  bool ro_rw_target = false;
+  CommandWorker::ticket_t ro_rw_ticket = 0;
+  CommandWorker::ticket_t mountTicket = 0;
+#endif
+
+  /// -------------- OVERLAY STATE --------------
+  bool overlayOpen = false;
+  bool overlayDirty = false;
+  Uint32 overlayDeadline = 0;
+  SDL_Surface* overlaySurface = NULL;
+
+  FunKeyMenuEntry& addZone(int type, const char* caption, int captionLine);
+  void registerZones();
+  void registerCustomZone(const CustomZone& custom);
+  void layoutMenuZone(FunKeyMenuEntry& zone);
+  void composeMenuZone(FunKeyMenuEntry& zone);
+  uint64_t zoneCacheKey(const std::vector<ENUM_MENU_TYPE>& types) const;
+  void initMenuZones();
+  void buildMenuZones();
+  bool zoneShown(int index) const;
+  int nextZone(int index, int step) const;
+  int zoneDistance(int index) const;
+  bool materializeZone(int index);
+  void prefetchZones();
+  void trimZones(int keepDistance);
+  int handleZoneKey(SDLKey key, int count = 1);
+  void renderConfirmation(SDL_Surface* screen, const char* progress, uint8_t confirmation, uint8_t action);
+#if defined(HAS_MENU_SAVE) || defined(HAS_MENU_LOAD)
+  int slotZoneStep(int delta);
+  int slotZoneKey(SDLKey key, uint8_t confirmation, bool loading);
+  void renderSlot(SDL_Surface* screen, const char* format, const char* progress, uint8_t confirmation, uint8_t action);
+#endif
+  void preload();
+  void waitPreload();
+#ifdef HAS_MENU_RO_RW
+  CommandWorker::ticket_t remount(bool readWrite);
+  bool pollRemount(bool wait);
+#endif
+  void initSystemValues();
+  void refreshSystemState();
+  bool pollSystemState();
+#ifdef HAS_MENU_VOLUME
+  void applyVolume(int percentage);
+#endif
+#ifdef HAS_MENU_BRIGHTNESS
+  void applyBrightness(int percentage);
+#endif
+  void persistSystemValues();
+
+  MenuRenderState currentRenderState(SDL_Surface* screen, int menuItem, int prevItem, int scroll, uint8_t menu_confirmation, uint8_t menu_action);
+  SDL_Rect progressBarChangedRect(int menuItem, int oldPercentage, int newPercentage);
+  SDL_Rect infoTextRect(SDL_Surface* screen);
+  void paintZones(SDL_Surface* screen, int menuItem, int prevItem, int scroll, uint8_t menu_confirmation, uint8_t menu_action);
+  void paint(SDL_Surface* screen, int menuItem, int prevItem, int scroll, uint8_t menu_confirmation, uint8_t menu_action);
+  void refresh(SDL_Surface* screen, int menuItem, int prevItem, int scroll, uint8_t menu_confirmation, uint8_t menu_action);
+
+  /* only quick adjustments are shown over the running game */
+  bool isOverlayZone(int index) const { return zones[index].bar != nullptr; }
+  SDL_Rect overlayRect(SDL_Surface* screen) const;
+  bool composeOverlay(SDL_Surface* screen);
+
+public:
+  CommandWorker commands;
+  FramePacer pacer;
+  MenuInput input;
+  DamageTracker damage;
+  FramePresenter presenter;
+  ScrollStrip scrollStrip;
+  MenuRenderState lastFrame;
+  bool lastFrameValid;
+
+  SDL_Surface* screen;
+  TTF_Font* fontTitle, *fontInfo, *fontSmallInfo;
+  SDL_Surface* upArrow, *downArrow;
+  SDL_Surface* zoneBackground;
+
+  SDL_Surface* backgroundBackup;
+  SDL_Surface* hostBackground;
+  SDL_Surface* hostSourceFrame;
+
+  FK_MenuFrameCallback frameCallback;
+  void* frameCallbackData;
+
+  FunKeyMenu(SDL_Surface* screen) : pacer(DEFAULT_FPS), lastFrameValid(false), screen(screen),
+    fontTitle(nullptr), fontInfo(nullptr), fontSmallInfo(nullptr), upArrow(nullptr), downArrow(nullptr), zoneBackground(nullptr),
+    backgroundBackup(nullptr), hostBackground(nullptr), hostSourceFrame(nullptr), frameCallback(nullptr), frameCallbackData(nullptr)
+  {
+
+  }
+
+  void setScreen(SDL_Surface* screen) { this->screen = screen; }
+
+  /* wakes up the menu loop if it is sleeping waiting for events, safe from any thread */
+  static void wakeUp()
+  {
+    SDL_Event event;
+    event.type = SDL_USEREVENT;
+    event.user.code = MENU_EVENT_WAKEUP;
+    event.user.data1 = event.user.data2 = nullptr;
+    SDL_PushEvent(&event);
+  }
+
+  /* drops wake ups left in the queue once the loop is done, other user events are given back to the host */
+  static void flushWakeUps()
+  {
+    /* the whole SDL 1.2 event queue */
+    SDL_Event events[128];
+    int count = SDL_PeepEvents(events, 128, SDL_GETEVENT, SDL_EVENTMASK(SDL_USEREVENT));
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+      if (events[i].user.code != MENU_EVENT_WAKEUP)
+        events[kept++] = events[i];
+    if (kept)
+      SDL_PeepEvents(events, kept, SDL_ADDEVENT, 0);
+  }
+
+  /* forces next refresh to repaint the whole screen */
+  void invalidateFrame()
+  {
+    lastFrameValid = false;
+    presenter.invalidate();
+    scrollStrip.invalidate();
+  }
+
+  /* converts surface to display format unless resources are being preloaded off the video thread,
+     waitPreload() converts them once they are published */
+  SDL_Surface* displayFormat(SDL_Surface* surface, bool rle)
+  {
+    return deferDisplayFormat ? surface : toDisplayFormat(surface, rle);
+  }
+
+  SDL_Surface* loadImageResource(const path_t& path, bool rle = true)
+  {
+    SDL_Surface* dest = bundle.image(path);
+    if (!dest)
+      dest = IMG_Load((Platform::resourcePath() + path).c_str());
+    if (!dest)
+      MENU_ERROR_PRINTF("ERROR IMG_Load: %s\n", IMG_GetError());
+    return displayFormat(dest, rle);
+  }
+
+  TTF_Font* loadFontResource(const path_t& path, int size)
+  {
+    TTF_Font* dest = bundle.font(path, size);
+    if (!dest)
+      dest = TTF_OpenFont((Platform::resourcePath() + path).c_str(), size);
+    if (!dest)
+      MENU_ERROR_PRINTF("ERROR in init_menu_SDL: Could not open menu font %s, %s\n", path.c_str(), SDL_GetError());
+    return dest;
+  }
+
+  void initTTF()
+  {
+    if (ttfUsers++ == 0)
+    {
+      wasTTFInit = TTF_WasInit();
+      if (!wasTTFInit)
+        TTF_Init();
+    }
+  }
+
+  void deinitTTF()
+  {
+    if (--ttfUsers == 0 && !wasTTFInit)
+      TTF_Quit();
+  }
+
+  /* resources come from the bundle if there is one, loose files are used for anything missing from it */
+  void loadResources()
+  {
+    if (!bundle.open(Platform::resourcePath() + MENU_RESOURCE_BUNDLE)) {
+      MENU_DEBUG_PRINTF("No menu resource bundle, loading loose files\n");
+    }
+
+    upArrow = loadImageResource("arrow_top.png");
+    downArrow = loadImageResource("arrow_bottom.png");
+    /* zones are drawn onto copies of it, RLE would only be undone by each one */
+    zoneBackground = loadImageResource("zone_bg.png", false);
+
+    fontTitle = loadFontResource("OpenSans-Bold.ttf", 22);
+    fontInfo = loadFontResource("OpenSans-Bold.ttf", 16);
+    fontSmallInfo = loadFontResource("OpenSans-Semibold.ttf", 13);
+  }
+
+  void releaseResources()
+  {
+    textCache.clear();
+
+    SDL_FreeSurface(upArrow);
+    SDL_FreeSurface(downArrow);
+    SDL_FreeSurface(zoneBackground);
+
+    TTF_CloseFont(fontTitle);
+    TTF_CloseFont(fontInfo);
+    TTF_CloseFont(fontSmallInfo);
+
+    /// ------ Nothing points into the bundle anymore ------
+    bundle.close();
+  }
+
+  /* packs the loose files loaded by loadResources() into a bundle */
+  static bool exportResources(const path_t& path)
+  {
+    return ResourceBundle::write(path, Platform::resourcePath(),
+      { "arrow_top.png", "arrow_bottom.png", "zone_bg.png" },
+      { "OpenSans-Bold.ttf", "OpenSans-Semibold.ttf" });
+  }
+
+  /* makes sure backgroundBackup can hold a copy of a surface like reference, it is kept between menu openings */
+  bool prepareBackgroundBackup(SDL_Surface* reference)
+  {
+    const SDL_PixelFormat* format = reference->format;
+
+    if (backgroundBackup && backgroundBackup->w == reference->w && backgroundBackup->h == reference->h &&
+      backgroundBackup->format->BitsPerPixel == format->BitsPerPixel && backgroundBackup->format->Rmask == format->Rmask &&
+      backgroundBackup->format->Gmask == format->Gmask && backgroundBackup->format->Bmask == format->Bmask)
+      return true;
+
+    SDL_FreeSurface(backgroundBackup);
+    backgroundBackup = SDL_CreateRGBSurface(SDL_SWSURFACE, reference->w, reference->h, format->BitsPerPixel,
+      format->Rmask, format->Gmask, format->Bmask, 0);
+    if (!backgroundBackup)
+      MENU_ERROR_PRINTF("ERROR Could not create background_screen: %s\n", SDL_GetError());
+    return backgroundBackup != nullptr;
+  }
+
+  /* surface the menu is drawn over: the frame handed over by the host if it can be used as is, or a copy of the screen */
+  SDL_Surface* captureBackground(SDL_Surface* screen)
+  {
+    SDL_Surface* frame = hostBackground;
+    hostBackground = nullptr;
+
+    if (frame && frame != screen && frame->w == screen->w && frame->h == screen->h)
+      return frame;
+
+    if (!prepareBackgroundBackup(screen))
+      return nullptr;
+
+    if (blitSurface(frame ? frame : screen, NULL, backgroundBackup, NULL)) {
+      MENU_ERROR_PRINTF("ERROR Could not copy screen: %s\n", SDL_GetError());
+    }
+    return backgroundBackup;
+  }
+
+  void releaseBackground()
+  {
+    SDL_FreeSurface(backgroundBackup);
+    backgroundBackup = nullptr;
+    hostBackground = nullptr;
+    hostSourceFrame = nullptr;
+  }
+
+  /* surface drawn behind the zone: on the aspect ratio zone, once it stopped scrolling, the background as it
+     would look in the selected mode */
+  SDL_Surface* backgroundFor(SDL_Surface* screen, int menuItem, int scroll)
+  {
+#ifdef HAS_MENU_ASPECT_RATIO
+    if (!scroll && zones[menuItem].type == MENU_TYPE_ASPECT_RATIO) {
+      SDL_Surface* preview = aspectPreview.get(screen, aspect_ratio, aspect_ratio_factor_percent);
+      if (preview)
+        return preview;
+    }
+#endif
+    return background_screen;
+  }
+
+  /* returns a fresh copy of the shared zone background, ready to be drawn on */
+  SDL_Surface* createZoneSurface()
+  {
+    if (!zoneBackground)
+      return nullptr;
+
+    SDL_Surface* surface = SDL_ConvertSurface(zoneBackground, zoneBackground->format, zoneBackground->flags);
+    if (!surface)
+      MENU_ERROR_PRINTF("ERROR Could not create menu zone surface: %s\n", SDL_GetError());
+    return surface;
+  }
+
+  void blitCentered(SDL_Surface* surface, int yOffset, SDL_Surface* dest)
+  {
+    SDL_Rect point;
+    point.x = (dest->w - menu_layout.zoneWidth()) / 2 + menu_layout.centeredX(surface->w);
+    point.y = dest->h - menu_layout.zoneHeight() + menu_layout.lineY(yOffset, surface->h);
+    blitSurface(surface, NULL, dest, &point);
+  }
+
+  void printCentered(TTF_Font* font, const char* text, SDL_Color color, int yOffset, SDL_Surface* dest)
+  {
+    SDL_Surface* surface = textCache.get(font, text, color);
+    if (surface)
+      blitCentered(surface, yOffset, dest);
+  }
+
+#ifdef HAS_MENU_THEME
+  void init(Configuration& c, bool async = false);
+#else
+  void init(bool async = false);
+#endif
+  void end();
+  int run(SDL_Surface* screen);
+
+  int openOverlay(int type);
+
+  int zoneIndex(int type) const
+  {
+    for (size_t i = 0; i < zones.size(); i++)
+      if (zones[i].type == type)
+        return (int)i;
+    return -1;
+  }
+  void closeOverlay();
+  bool handleOverlayEvent(const SDL_Event& event);
+  bool updateOverlay();
+  void compositeOverlay(SDL_Surface* screen);
+
+  int addCustomZone(const FK_MenuZone& desc);
+
+  /* file the composed zones are cached to, empty to disable. It is used by next init(), or right away once initialized */
+  void setZoneCache(const path_t& path);
+
+  /* states are written and read by the menu from then on, once pending ones have reached the disk */
+  void setSaveStateService(const path_t& path, const FK_SaveStateCallbacks* callbacks)
+  {
+    commands.flush();
+    saves.setup(path, callbacks);
+  }
+
+  void setSaveStateDeltas(int percent) { saves.setDeltas(percent); }
+
+#ifdef HAS_MENU_ASPECT_RATIO
+  int getAspectRatio() const { return aspect_ratio; }
+  int getAspectRatioFactor() const { return aspect_ratio_factor_percent; }
+
+  void setAspectRatio(int ratio, int factorPercent)
+  {
+    aspect_ratio = (ratio >= 0 && ratio < NB_ASPECT_RATIOS_TYPES) ? ratio : ASPECT_RATIOS_TYPE_STRECHED;
+    aspect_ratio_factor_percent = MIN(MAX(factorPercent, 0), 100);
+  }
+#endif
+
+  int loadQuickState() { return saves.isEnabled() && saves.load(commands, SaveStateService::QUICK_SLOT) ? 0 : -1; }
+
+  void setSystemStateFreshness(int ms) { systemState.setFreshness(ms); }
+
+  /* most zone surfaces kept built, cold ones are freed once over it, 0 to keep them all */
+  void setZoneBudget(int budget)
+  {
+    zoneBudget = budget > 0 ? budget : 0;
+    if (initCount && !preloadTicket)
+      trimZones(1);
+  }
+
+  /* only a running menu loop takes the wake up, the host would get it otherwise */
+  void stop()
+  {
+    stop_menu_loop = 1;
+    if (loopRunning)
+      wakeUp();
+  }
+};
+
+bool FunKeyMenu::wasTTFInit = false;
+int FunKeyMenu::ttfUsers = 0;
+
+/// -------------- FUNCTIONS IMPLEMENTATION --------------
+
+FunKeyMenuEntry& FunKeyMenu::addZone(int type, const char* caption, int captionLine)
+{
+  zones.emplace_back(type, caption, captionLine);
+  return zones.back();
+}
+
+/* lines shown below a zone while its action runs or awaits confirmation */
+void FunKeyMenu::renderConfirmation(SDL_Surface* screen, const char* progress, uint8_t confirmation, uint8_t action)
+{
+  if (action) {
+    printCentered(fontInfo, progress, text_color, +2, screen);
+  }
+  else if (confirmation) {
+    printCentered(fontInfo, "Are you sure?", text_color, +2, screen);
+  }
+}
+
+#if defined(HAS_MENU_SAVE) || defined(HAS_MENU_LOAD)
+int FunKeyMenu::slotZoneStep(int delta)
+{
+  MENU_DEBUG_PRINTF("Slot %+d\n", delta);
+  savestate_slot = ((savestate_slot + delta) % MAX_SAVE_SLOTS + MAX_SAVE_SLOTS) % MAX_SAVE_SLOTS;
+  savestate_failed = 0;
+  return MENU_ZONE_REFRESH;
+}
+
+int FunKeyMenu::slotZoneKey(SDLKey key, uint8_t confirmation, bool loading)
+{
+  switch (key) {
+  case SDLK_RETURN:
+    MENU_DEBUG_PRINTF("Slot %d - %s\n", savestate_slot, confirmation ? "confirmed" : "asking confirmation");
+    savestate_failed = 0;
+    if (!confirmation) {
+      return MENU_ZONE_CONFIRM;
+    }
+
+    /// ------ Without a save state service the host does the I/O once the menu is closed ------
+    if (saves.isEnabled()) {
+      bool done = loading ? saves.load(commands, savestate_slot) : saves.save(commands, savestate_slot, background_screen);
+      if (!done) {
+        savestate_failed = 1;
+        return MENU_ZONE_REFRESH;
+      }
+    }
+    return MENU_ZONE_CLOSE;
+  default:
+    return MENU_ZONE_IGNORED;
+  }
+}
+
+/* selected slot and, with a save state service, its date and the thumbnail of the screen it was saved from */
+void FunKeyMenu::renderSlot(SDL_Surface* screen, const char* format, const char* progress, uint8_t confirmation, uint8_t action)
+{
+  char text_tmp[100];
+  sprintf(text_tmp, format, savestate_slot + 1);
+  printCentered(fontInfo, text_tmp, text_color, 0, screen);
+
+  if (confirmation || action) {
+    renderConfirmation(screen, progress, confirmation, action);
+    return;
+  }
+  if (savestate_failed) {
+    printCentered(fontInfo, "Failed!", text_color, +2, screen);
+    return;
+  }
+  if (!saves.isEnabled()) {
+    return;
+  }
+
+  /// ------ Preview from the slot index ------
+  int64_t time = 0;
+  SDL_Surface* thumbnail = saves.preview(savestate_slot, time);
+  if (!time) {
+    printCentered(fontSmallInfo, "Empty", text_color, +1, screen);
+    return;
+  }
+
+  char date[32];
+  time_t seconds = (time_t)time;
+  strftime(date, sizeof(date), "%d/%m/%Y %H:%M", localtime(&seconds));
+  printCentered(fontSmallInfo, date, text_color, +1, screen);
+
+  if (thumbnail) {
+    SDL_Rect pos;
+    pos.x = (screen->w - thumbnail->w) / 2;
+    pos.y = screen->h - menu_layout.zoneHeight() + menu_layout.thumbnailY();
+    blitSurface(thumbnail, NULL, screen, &pos);
+  }
+}
+#endif
+
+/* the built-in zones of FK_MENU_ZONE_LIST, in the order they are shown */
+void FunKeyMenu::registerZones()
+{
+  zones.clear();
+
+  for (ENUM_MENU_TYPE type : menu_zone_list) {
+    switch (type)
+    {
+#ifdef HAS_MENU_VOLUME
+    case MENU_TYPE_VOLUME:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_VOLUME, "VOLUME", -1);
+      zone.bar = &volume_bar;
+      zone.barValue = &volume_percentage;
+      zone.barSteps = 100 / STEP_CHANGE_VOLUME;
+      zone.onStep = [this](int delta) -> int {
+        volume_percentage = MIN(MAX(volume_percentage + delta * STEP_CHANGE_VOLUME, 0), 100);
+
+        /// ----- Apply in background, once per burst ----
+        applyVolume(volume_percentage);
+        return MENU_ZONE_REFRESH;
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_BRIGHTNESS
+    case MENU_TYPE_BRIGHTNESS:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_BRIGHTNESS, "BRIGHTNESS", -1);
+      zone.bar = &brightness_bar;
+      zone.barValue = &brightness_percentage;
+      zone.barSteps = 100 / STEP_CHANGE_BRIGHTNESS;
+      zone.onStep = [this](int delta) -> int {
+        brightness_percentage = MIN(MAX(brightness_percentage + delta * STEP_CHANGE_BRIGHTNESS, 0), 100);
+
+        /// ----- Apply in background, once per burst ----
+        applyBrightness(brightness_percentage);
+        return MENU_ZONE_REFRESH;
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_SAVE
+    case MENU_TYPE_SAVE:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_SAVE, "SAVE", -2);
+      zone.showsAction = true;
+      zone.onKey = [this](SDLKey key, uint8_t confirmation) { return slotZoneKey(key, confirmation, false); };
+      zone.onStep = [this](int delta) { return slotZoneStep(delta); };
+      zone.render = [this](SDL_Surface* screen, uint8_t confirmation, uint8_t action) {
+        renderSlot(screen, "IN SLOT   < %d >", "Saving...", confirmation, action);
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_LOAD
+    case MENU_TYPE_LOAD:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_LOAD, "LOAD", -2);
+      zone.showsAction = true;
+      zone.onKey = [this](SDLKey key, uint8_t confirmation) { return slotZoneKey(key, confirmation, true); };
+      zone.onStep = [this](int delta) { return slotZoneStep(delta); };
+      zone.render = [this](SDL_Surface* screen, uint8_t confirmation, uint8_t action) {
+        renderSlot(screen, "FROM SLOT   < %d >", "Loading...", confirmation, action);
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_ASPECT_RATIO
+    case MENU_TYPE_ASPECT_RATIO:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_ASPECT_RATIO, "ASPECT RATIO", -1);
+      zone.onStep = [this](int delta) -> int {
+        aspect_ratio = ((aspect_ratio + delta) % NB_ASPECT_RATIOS_TYPES + NB_ASPECT_RATIOS_TYPES) % NB_ASPECT_RATIOS_TYPES;
+        return MENU_ZONE_REFRESH;
+      };
+      zone.render = [this](SDL_Surface* screen, uint8_t, uint8_t) {
+        char text_tmp[100];
+        sprintf(text_tmp, "<   %s   >", aspect_ratio_name[aspect_ratio]);
+        printCentered(fontInfo, text_tmp, text_color, +1, screen);
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_RO_RW
+    case MENU_TYPE_RO_RW:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_RO_RW, "SET SYSTEM:", -2);
+      zone.showsAction = true;
+      zone.onKey = [this](SDLKey key, uint8_t confirmation) -> int {
+        if (key != SDLK_RETURN)
+          return MENU_ZONE_IGNORED;
+        if (!confirmation)
+          return MENU_ZONE_CONFIRM;
+
+        /// ----- One remount at a time, the pending one is still shown in progress ----
+        if (ro_rw_ticket)
+          return MENU_ZONE_REFRESH;
+
+        /// ----- Remount, result is read back in the main loop ----
+        MENU_DEBUG_PRINTF("SYSTEM %s - confirmed\n", read_write ? "RO" : "RW");
+        ro_rw_target = !read_write;
+        ro_rw_ticket = remount(ro_rw_target);
+        return MENU_ZONE_REFRESH;
+      };
+      zone.render = [this](SDL_Surface* screen, uint8_t confirmation, uint8_t action) {
+        printCentered(fontInfo, read_write ? "READ-ONLY" : "READ-WRITE", text_color, 0, screen);
+        renderConfirmation(screen, "in progress ...", confirmation, action);
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_EXIT
+    case MENU_TYPE_EXIT:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_EXIT, "EXIT APP", 0);
+      zone.showsAction = true;
+      zone.onKey = [this](SDLKey key, uint8_t confirmation) -> int {
+        if (key != SDLK_RETURN)
+          return MENU_ZONE_IGNORED;
+
+        MENU_DEBUG_PRINTF("Exit game - %s\n", confirmation ? "confirmed" : "asking confirmation");
+        if (!confirmation)
+          return MENU_ZONE_CONFIRM;
+
+        /// ----- The game is quick saved by the service, or should be by the host, back to launcher ----
+        if (saves.isEnabled() && !saves.save(commands, SaveStateService::QUICK_SLOT, background_screen))
+          return MENU_ZONE_REFRESH;
+        return MENU_ZONE_EXIT;
+      };
+      zone.render = [this](SDL_Surface* screen, uint8_t confirmation, uint8_t action) {
+        renderConfirmation(screen, "Shutting down...", confirmation, action);
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_USB
+    case MENU_TYPE_USB:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_USB, "USB", 0);
+      zone.showsAction = true;
+      zone.onKey = [this](SDLKey key, uint8_t confirmation) -> int {
+        if (key != SDLK_RETURN)
+          return MENU_ZONE_IGNORED;
+        if (!confirmation)
+          return MENU_ZONE_CONFIRM;
+
+        MENU_DEBUG_PRINTF("%s USB - confirmed\n", usb_sharing ? "Unmount" : "Mount");
+        bool res = Utils::executeRawPath(usb_sharing ? SHELL_CMD_USB_UNMOUNT : SHELL_CMD_USB_MOUNT);
+        if (!res) {
+          MENU_ERROR_PRINTF("Failed to run command %s\n", usb_sharing ? SHELL_CMD_USB_UNMOUNT : SHELL_CMD_USB_MOUNT);
+        }
+        else {
+          usb_sharing = !usb_sharing;
+          systemState.setUsbSharing(usb_sharing);
+        }
+        return MENU_ZONE_REFRESH;
+      };
+      zone.render = [this](SDL_Surface* screen, uint8_t confirmation, uint8_t action) {
+        char text_tmp[100];
+        sprintf(text_tmp, "%s USB", usb_sharing ? "EJECT" : "MOUNT");
+        printCentered(fontTitle, text_tmp, text_color, 0, screen);
+        renderConfirmation(screen, "in progress ...", confirmation, action);
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_THEME
+    case MENU_TYPE_THEME:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_THEME, "SET THEME", -2);
+      zone.showsAction = true;
+      zone.onKey = [this](SDLKey key, uint8_t confirmation) -> int {
+        switch (key) {
+        case SDLK_LEFT:
+          indexChooseLayout = (!indexChooseLayout) ? (config->layouts_.size() - 1) : (indexChooseLayout - 1);
+          return MENU_ZONE_REFRESH;
+        case SDLK_RIGHT:
+          indexChooseLayout = (indexChooseLayout + 1) % config->layouts_.size();
+          return MENU_ZONE_REFRESH;
+        case SDLK_RETURN:
+          if (!confirmation)
+            return MENU_ZONE_CONFIRM;
+
+          /// ----- Write new theme and restart RetroFe ----
+          MENU_DEBUG_PRINTF("Theme change - confirmed\n");
+          config->exportCurrentLayout(Utils::combinePath(Configuration::absolutePath, "layout.conf"),
+            Utils::getFileName(config->layouts_.at(indexChooseLayout)));
+          return MENU_ZONE_EXIT;
+        default:
+          return MENU_ZONE_IGNORED;
+        }
+      };
+      zone.render = [this](SDL_Surface* screen, uint8_t confirmation, uint8_t action) {
+        char text_tmp[100];
+        bool dots = false;
+        size_t max_chars = 15;
+
+        /// ---- Write current chosen theme -----
+        char* curLayoutName = (char*)Utils::getFileName(config->layouts_.at(indexChooseLayout)).c_str();
+
+        // no more than max_chars chars in name to fit screen
+        if (strlen(curLayoutName) > max_chars) {
+          curLayoutName[max_chars - 2] = 0;
+          dots = true;
+        }
+        sprintf(text_tmp, "< %s%s >", curLayoutName, dots ? "..." : "");
+
+        printCentered(fontInfo, text_tmp, text_color, 0, screen);
+        renderConfirmation(screen, "In progress...", confirmation, action);
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_LAUNCHER
+    case MENU_TYPE_LAUNCHER:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_LAUNCHER, "SET LAUNCHER", -2);
+      zone.showsAction = true;
+      zone.compose = [this](SDL_Surface* surface) {
+        printCentered(fontTitle, "GMENU2X", text_color, 0, surface);
+      };
+      zone.onKey = [](SDLKey key, uint8_t confirmation) -> int {
+        if (key != SDLK_RETURN)
+          return MENU_ZONE_IGNORED;
+        if (!confirmation)
+          return MENU_ZONE_CONFIRM;
+
+        /// ----- Shell cmd ----
+        MENU_DEBUG_PRINTF("Running command: %s\n", SHELL_CMD_SET_LAUNCHER_GMENU2X);
+        Utils::executeRawPath(SHELL_CMD_SET_LAUNCHER_GMENU2X);
+        return MENU_ZONE_EXIT;
+      };
+      zone.render = [this](SDL_Surface* screen, uint8_t confirmation, uint8_t action) {
+        renderConfirmation(screen, "In progress...", confirmation, action);
+      };
+      break;
+    }
+#endif
+#ifdef HAS_MENU_POWERDOWN
+    case MENU_TYPE_POWERDOWN:
+    {
+      FunKeyMenuEntry& zone = addZone(MENU_TYPE_POWERDOWN, "POWERDOWN", 0);
+      zone.showsAction = true;
+      zone.onKey = [this](SDLKey key, uint8_t confirmation) -> int {
+        if (key != SDLK_RETURN)
+          return MENU_ZONE_IGNORED;
+        if (!confirmation)
+          return MENU_ZONE_CONFIRM;
+
+        /// ----- Shell cmd, "Shutting down..." stays on screen ----
+        MENU_DEBUG_PRINTF("Powerdown - confirmed\n");
+        commands.postShell(SHELL_CMD_POWERDOWN, SHELL_CMD_POWERDOWN);
+        return MENU_ZONE_EXIT | MENU_ZONE_KEEP_SCREEN;
+      };
+      zone.render = [this](SDL_Surface* screen, uint8_t confirmation, uint8_t action) {
+        renderConfirmation(screen, "Shutting down...", confirmation, action);
+      };
+      break;
+    }
+#endif
+    default:
+      break;
+    }
+  }
+
+  /// ------ Host zones survive an end and init cycle ------
+  for (const CustomZone& custom : customZones) {
+    registerCustomZone(custom);
+  }
+}
+
+/* geometry of the elements drawn over a zone at runtime */
+void FunKeyMenu::layoutMenuZone(FunKeyMenuEntry& zone)
+{
+  SDL_Surface* surface = zone.surface;
+  if (zone.bar) {
+    uint16_t x = (surface->w - menu_layout.zoneWidth()) / 2 + menu_layout.barX();
+    uint16_t y = surface->h - menu_layout.zoneHeight() + menu_layout.barY();
+    zone.bar->setup(surface, x, y, menu_layout.barWidth, menu_layout.barHeight, zone.barSteps);
+  }
+}
+
+/* static content of a zone, skipped for zones coming from the zone cache */
+void FunKeyMenu::composeMenuZone(FunKeyMenuEntry& zone)
+{
+  MENU_DEBUG_PRINTF("Init zone %s\n", zone.caption.c_str());
+
+  if (!zone.caption.empty()) {
+    printCentered(fontTitle, zone.caption.c_str(), text_color, zone.captionLine, zone.surface);
+  }
+  if (zone.compose) {
+    zone.compose(zone.surface);
+  }
+  if (zone.bar) {
+    zone.bar->draw(zone.surface, 0);
+  }
+}
+
+/* zone added by the host, built on first visit like the others and kept for later inits */
+int FunKeyMenu::addCustomZone(const FK_MenuZone& desc)
+{
+  if (!initCount) {
+    MENU_ERROR_PRINTF("FK_AddMenuZone called before FK_InitMenu\n");
+    return -1;
+  }
+  waitPreload();
+  if (customZones.full() || zones.full()) {
+    MENU_ERROR_PRINTF("FK_AddMenuZone: no room for more than %d zones\n", MAX_CUSTOM_MENU_ZONES);
+    return -1;
+  }
+
+  registerCustomZone(customZones.emplace_back(desc));
+
+  /// ------ Strip may hold a neighbour of the new zone ------
+  invalidateFrame();
+  return (int)zones.size() - 1;
+}
+
+void FunKeyMenu::registerCustomZone(const CustomZone& custom)
+{
+  const FK_MenuZone desc = custom.desc;
+  FunKeyMenuEntry& zone = addZone(NB_MENU_TYPES, custom.caption.c_str(), -1);
+  zone.showsAction = desc.shows_action != 0;
+  if (desc.compose) {
+    zone.compose = [desc](SDL_Surface* surface) { desc.compose(surface, desc.userdata); };
+  }
+  if (desc.render) {
+    zone.render = [desc](SDL_Surface* screen, uint8_t confirmation, uint8_t action) { desc.render(screen, confirmation, action, desc.userdata); };
+  }
+  if (desc.on_key) {
+    zone.onKey = [desc](SDLKey key, uint8_t confirmation) { return desc.on_key(key, confirmation, desc.userdata); };
+  }
+}
+
+/* runs a key on the zone shown, the meaning of confirmation is shared by all zones */
+int FunKeyMenu::handleZoneKey(SDLKey key, int count)
+{
+  FunKeyMenuEntry& zone = zones[menuItem];
+  bool stepped = zone.onStep && (key == SDLK_LEFT || key == SDLK_RIGHT);
+  if (!zone.onKey && !stepped)
+    return MENU_ZONE_IGNORED;
+
+  bool confirmed = key == SDLK_RETURN && menu_confirmation;
+
+  /// ------ Show the action in progress while it runs ------
+  if (confirmed && zone.showsAction) {
+    refresh(screen, menuItem, menuItem, 0, menu_confirmation, 1);
+  }
+
+  /// ------ A burst is one step of its net delta, or one call per press for zones taking keys only ------
+  int result = MENU_ZONE_IGNORED;
+  if (stepped) {
+    result = zone.onStep(key == SDLK_RIGHT ? count : -count);
+  }
+  else {
+    for (int i = 0; i < count && !(result & (MENU_ZONE_CLOSE | MENU_ZONE_EXIT)); i++) {
+      result |= zone.onKey(key, menu_confirmation);
+    }
+  }
+
+  if (result & MENU_ZONE_CONFIRM) {
+    menu_confirmation = 1;
+    result |= MENU_ZONE_REFRESH;
+  }
+  else if (confirmed) {
+    /// ------ A confirmation is only good for one action ------
+    menu_confirmation = 0;
+    result |= MENU_ZONE_REFRESH;
+  }
+
+  if (zone.isCustom() && (result & MENU_ZONE_REFRESH)) {
+    zone.revision++;
+  }
+  return result;
+}
+
+/* everything the composed zones depend on which is not known at build time */
+uint64_t FunKeyMenu::zoneCacheKey(const std::vector<ENUM_MENU_TYPE>& types) const
+{
+  Fnv1a hash;
+  hash.add(ZoneCache::version());
+
+  for (ENUM_MENU_TYPE type : types)
+    hash.add(type);
+
+  static const char* const sources[] = { MENU_RESOURCE_BUNDLE, "zone_bg.png", "OpenSans-Bold.ttf" };
+  for (const char* source : sources)
+    hash.add(Platform::modificationTime(Platform::resourcePath() + source));
+
+  const SDL_Surface* video = SDL_GetVideoSurface();
+  const SDL_PixelFormat* formats[] = { video ? video->format : nullptr, zoneBackground ? zoneBackground->format : nullptr };
+  for (const SDL_PixelFormat* format : formats) {
+    if (format) {
+      hash.add(format->BitsPerPixel);
+      hash.add(format->Rmask);
+      hash.add(format->Gmask);
+      hash.add(format->Bmask);
+      hash.add(format->Amask);
+    }
+  }
+
+  return hash.value;
+}
+
+void FunKeyMenu::initMenuZones()
+{
+  registerZones();
+  buildMenuZones();
+}
+
+/* composes the registered zones, loading them from the zone cache or writing it when enabled */
+void FunKeyMenu::buildMenuZones()
+{
+  std::vector<ENUM_MENU_TYPE> types;
+  for (const FunKeyMenuEntry& zone : zones) {
+    types.push_back((ENUM_MENU_TYPE)zone.type);
+  }
+
+  /// ------ Warm start: zones come composed from the cache ------
+  std::vector<SDL_Surface*> cached;
+  uint64_t key = zoneCache.isEnabled() ? zoneCacheKey(types) : 0;
+  bool hit = zoneCache.isEnabled() && zoneCache.load(key, types, cached);
+  MENU_DEBUG_PRINTF("Zone cache %s\n", hit ? "hit" : "miss");
+
+  builtZones = 0;
+  if (hit) {
+    for (size_t i = 0; i < zones.size(); i++) {
+      zones[i].surface = displayFormat(cached[i], true);
+      layoutMenuZone(zones[i]);
+      builtZones++;
+    }
+  }
+  /// ------ Cold start with a cache: all zones are needed to write it ------
+  else if (zoneCache.isEnabled()) {
+    bool complete = true;
+    for (size_t i = 0; i < zones.size(); i++) {
+      FunKeyMenuEntry& zone = zones[i];
+      zone.surface = createZoneSurface();
+      if (!zone.surface) {
+        complete = false;
+        continue;
+      }
+      layoutMenuZone(zone);
+      composeMenuZone(zone);
+      builtZones++;
+    }
+
+    if (complete) {
+      std::vector<SDL_Surface*> surfaces;
+      for (const FunKeyMenuEntry& zone : zones) {
+        surfaces.push_back(zone.surface);
+      }
+      zoneCache.save(key, types, surfaces);
+    }
+
+    /// ------ Zones are complete, encode them for fast blits -------
+    for (FunKeyMenuEntry& zone : zones) {
+      zone.surface = displayFormat(zone.surface, true);
+    }
+  }
+  /// ------ Otherwise zones are built on first visit, only the first shown and its neighbours now ------
+  else if (!zones.empty()) {
+    prefetchZones();
+  }
+  trimZones(1);
+}
+
+/* an initialized menu composes its zones again right away, so that the new cache is loaded or written now */
+void FunKeyMenu::setZoneCache(const path_t& path)
+{
+  zoneCache.setPath(path);
+  if (!initCount)
+    return;
+
+  waitPreload();
+  for (FunKeyMenuEntry& zone : zones) {
+    SDL_FreeSurface(zone.surface);
+    zone.surface = nullptr;
+  }
+  builtZones = 0;
+  buildMenuZones();
+  invalidateFrame();
+}
+
+/* builds the surface of a zone if it is not already, it must then be composed again from scratch */
+bool FunKeyMenu::materializeZone(int index)
+{
+  FunKeyMenuEntry& zone = zones[index];
+  if (zone.surface)
+    return true;
+
+  zone.surface = createZoneSurface();
+  if (!zone.surface)
+    return false;
+
+  layoutMenuZone(zone);
+  composeMenuZone(zone);
+  zone.surface = displayFormat(zone.surface, true);
+  builtZones++;
+  return true;
+}
+
+/* zones a move can land on, the USB one only while USB data is connected */
+bool FunKeyMenu::zoneShown(int index) const
+{
+#ifdef HAS_MENU_USB
+  if (zones[index].type == MENU_TYPE_USB && !usb_data_connected)
+    return false;
+#else
+  (void)index;
+#endif
+  return true;
+}
+
+/* zone one move away from index, step gives the direction */
+int FunKeyMenu::nextZone(int index, int step) const
+{
+  int count = (int)zones.size();
+  for (int i = 0; i < count; i++) {
+    index = (index + step + count) % count;
+    if (zoneShown(index))
+      break;
+  }
+  return index;
+}
+
+/* moves from the zone shown to index, zones never shown are the farthest */
+int FunKeyMenu::zoneDistance(int index) const
+{
+  int count = (int)zones.size();
+  if (!zoneShown(index))
+    return count;
+
+  int forward = 0, backward = 0;
+  for (int i = menuItem; i != index && forward < count; i = nextZone(i, +1))
+    forward++;
+  for (int i = menuItem; i != index && backward < count; i = nextZone(i, -1))
+    backward++;
+  return MIN(forward, backward);
+}
+
+/* builds the zone shown and the ones a move lands on, so that a scroll never waits for a zone to be composed */
+void FunKeyMenu::prefetchZones()
+{
+  materializeZone(menuItem);
+  materializeZone(nextZone(menuItem, +1));
+  materializeZone(nextZone(menuItem, -1));
+}
+
+/* frees the zones farthest from the one shown until zoneBudget is met, zones within keepDistance of it are
+   never freed so the budget is only a target while the menu is shown */
+void FunKeyMenu::trimZones(int keepDistance)
+{
+  if (!zoneBudget)
+    return;
+
+  int count = (int)zones.size();
+  while (builtZones > zoneBudget) {
+    int farthest = -1;
+    int farthestDistance = keepDistance;
+    for (int i = 0; i < count; i++) {
+      int distance = zoneDistance(i);
+      if (zones[i].surface && distance > farthestDistance) {
+        farthest = i;
+        farthestDistance = distance;
+      }
+    }
+    if (farthest < 0)
+      break;
+
+    MENU_DEBUG_PRINTF("Free zone %s\n", zones[farthest].caption.c_str());
+    SDL_FreeSurface(zones[farthest].surface);
+    zones[farthest].surface = nullptr;
+    builtZones--;
+
+    /// ------ Strip may have been composed from a freed zone ------
+    scrollStrip.invalidate();
+  }
+}
+
+/* decodes resources and composes zones, safe to run on the command worker while nothing else touches them */
+void FunKeyMenu::preload()
+{
+  MENU_PROFILE_SCOPE(MENU_STAT_PRELOAD);
+
+  loadResources();
+
+  /// ------ Init menu zones ------
+  initMenuZones();
+}
+
+#ifdef HAS_MENU_RO_RW
+/* queued on the command worker, the helper only runs and syncs if the mount state still differs once it gets there */
+CommandWorker::ticket_t FunKeyMenu::remount(bool readWrite)
+{
+  return commands.post("ro_rw", [readWrite] {
+    if (Platform::mountState(RO_RW_MOUNT_POINT) == (readWrite ? 1 : 0)) {
+      return 0;
+    }
+
+    const char* command = readWrite ? SHELL_CMD_RW : SHELL_CMD_RO;
+    int status = CommandWorker::runShell(command);
+    if (status < 0) {
+      MENU_ERROR_PRINTF("Failed to run command %s\n", command);
+    }
+    return status;
+  });
+}
+
+/* reads back the remount asked from the RO/RW zone, blocking for it if wait is set. Returns true once done */
+bool FunKeyMenu::pollRemount(bool wait)
+{
+  if (!ro_rw_ticket) {
+    return false;
+  }
+
+  int status;
+  if (wait) {
+    status = commands.wait(ro_rw_ticket);
+  }
+  else if (!commands.result(ro_rw_ticket, status)) {
+    return false;
+  }
+  ro_rw_ticket = 0;
+
+  /// ------ Mount state as it is now, or as asked if it cannot be read ------
+  int mounted = Platform::mountState(RO_RW_MOUNT_POINT);
+  if (mounted >= 0) {
+    read_write = mounted;
+  }
+  else if (status >= 0) {
+    read_write = ro_rw_target;
+  }
+  return true;
+}
+#endif
+
+/* blocks until a pending preload has published its resources, then finishes them on the video thread */
+void FunKeyMenu::waitPreload()
+{
+  if (!preloadTicket)
+    return;
+
+  MENU_DEBUG_PRINTF("Waiting for menu preload\n");
+  commands.wait(preloadTicket);
+  preloadTicket = 0;
+
+  /// ------ Surfaces were decoded in software format, convert them for fast blits ------
+  deferDisplayFormat = false;
+  upArrow = toDisplayFormat(upArrow, true);
+  downArrow = toDisplayFormat(downArrow, true);
+  zoneBackground = toDisplayFormat(zoneBackground, false);
+  for (FunKeyMenuEntry& zone : zones) {
+    zone.surface = toDisplayFormat(zone.surface, true);
+  }
+
+  /// ------ Titles rendered while preloading are not needed anymore ------
+  textCache.clear();
+  textCache.setDisplayFormat(true);
+}
+
+/* with async set resources are prepared on the command worker and the call returns right away,
+   FK_RunMenu or FK_EndMenu wait for them to be ready */
+#ifdef HAS_MENU_THEME
+void FunKeyMenu::init(Configuration& c, bool async)
+#else
+void FunKeyMenu::init(bool async)
+#endif
+{
+  MENU_PROFILE_SCOPE(MENU_STAT_INIT);
+
+#ifdef HAS_MENU_THEME
+  /// ------ Save config pointer ------
+  config = &c;
+#endif
+
+  /// ------ Already prepared: only take a reference ------
+  if (initCount++ > 0) {
+    MENU_DEBUG_PRINTF("Init Menu (already done, %d users)\n", initCount);
+    return;
+  }
+
+  MENU_DEBUG_PRINTF("Init Menu%s\n", async ? " (async)" : "");
+
+  /// ------ TTF global state is set up by the calling thread, only fonts are opened by the worker ------
+  initTTF();
+
+  if (async) {
+    deferDisplayFormat = true;
+    textCache.setDisplayFormat(false);
+    preloadTicket = commands.post("preload", [this] { preload(); return 0; });
+  }
+  else {
+    preload();
+  }
+
+  /// ------ System values are read in background for the first FK_RunMenu ------
+  refreshSystemState();
+
+#ifdef HAS_MENU_RO_RW
+  /// ------ Back to read-only, the mount state is read again by FK_RunMenu once done ------
+  mountTicket = remount(false);
+#endif
+
+  /// ------ Preallocate screen backup for first FK_RunMenu ------
+  if (SDL_GetVideoSurface()) {
+    prepareBackgroundBackup(SDL_GetVideoSurface());
+  }
+
+  return;
+}
+
+
+void FunKeyMenu::end()
+{
+  /// ------ Resources stay loaded until the last user is gone ------
+  if (initCount == 0) {
+    MENU_ERROR_PRINTF("FK_EndMenu called on a menu which is not initialized\n");
+    return;
+  }
+  if (--initCount > 0) {
+    return;
+  }
+
+  MENU_DEBUG_PRINTF("End Menu \n");
+
+#ifdef MENU_PROFILE_DUMP
+  MenuProfiler::dump();
+#endif
+
+  /// ------ Resources can only be released once they are published ------
+  waitPreload();
+
+  /// ------ Changed values of an overlay left open are persisted too ------
+  closeOverlay();
+
+#ifdef HAS_MENU_RO_RW
+  /// ------ Back to read-only once the toggle asked last is read back, a no-op unless it was made read-write ------
+  pollRemount(true);
+  remount(false);
+#endif
+
+  /// ------ Let pending commands land before tearing down ------
+  commands.stop();
+  systemStateTicket = 0;
+#ifdef HAS_MENU_RO_RW
+  mountTicket = 0;
+#endif
+
+  releaseResources();
+  deinitTTF();
+  scrollStrip.release();
+  saves.releaseThumbnails();
+  releaseBackground();
+#ifdef HAS_MENU_VOLUME
+  volume_bar.releaseTiles();
+#endif
+#ifdef HAS_MENU_BRIGHTNESS
+  brightness_bar.releaseTiles();
+#endif
+
+  /// ------ Free Surfaces -------
+  for (FunKeyMenuEntry& zone : zones) {
+    SDL_FreeSurface(zone.surface);
+  }
+
+  /// ------ Free Menu memory and reset vars -----
+  zones.clear();
+  builtZones = 0;
+  menuItem = 0;
+
+  return;
+}
+
+void FunKeyMenu::initSystemValues()
+{
+  MENU_PROFILE_SCOPE(MENU_STAT_SYSTEM_VALUES);
+
+  /// ------- A refresh which landed while the menu was closed is already in the snapshot --------
+  int status;
+  if (systemStateTicket && commands.result(systemStateTicket, status)) {
+    systemStateTicket = 0;
+  }
+
+  /// ------- Snapshot, only waited for if it was never read --------
+  SystemSnapshot values;
+  bool stale;
+  if (!systemState.get(values, stale)) {
+    if (!systemStateTicket) {
+      refreshSystemState();
+    }
+    commands.wait(systemStateTicket);
+    systemStateTicket = 0;
+    systemState.get(values, stale);
+  }
+  else if (stale && !systemStateTicket) {
+    refreshSystemState();
+  }
+
+#ifdef HAS_MENU_VOLUME
+  /// ------- Get system volume percentage --------
+  volume_percentage = values.hasVolume ? values.volume : 50; ///wrong value: setting default to 50
+  MENU_DEBUG_PRINTF("System volume = %d%%\n", volume_percentage);
+  initial_volume_percentage = volume_percentage;
+#endif
+#ifdef HAS_MENU_BRIGHTNESS
+  /// ------- Get system brightness percentage -------
+  brightness_percentage = values.hasBrightness ? values.brightness : 50; ///wrong value: setting default to 50
+  MENU_DEBUG_PRINTF("System brightness = %d%%\n", brightness_percentage);
+  initial_brightness_percentage = brightness_percentage;
+#endif
+#ifdef HAS_MENU_RO_RW
+  /// ------- Actual mount state, unless a remount is still queued and will be read back once done -------
+  pollRemount(false);
+  int mounted = Platform::mountState(RO_RW_MOUNT_POINT);
+  if (mounted >= 0 && !ro_rw_ticket) {
+    read_write = mounted;
+  }
+#endif
+#ifdef HAS_MENU_USB
+  /// ------- Get USB Value -------
+  usb_data_connected = values.usbDataConnected;
+  usb_sharing = values.usbSharing;
+
+  /** Sanity check if usb not connected */
+  if (!usb_data_connected) {
+    usb_sharing = 0;
+
+    if (zones[menuItem].type == MENU_TYPE_USB) {
+      menuItem = 0;
+    }
+  }
+
+  /** Sanity check if currently in USB sharing (should not happen) */
+  if (usb_sharing) {
+
+    /// Force USB menu to launch
+    for (int cur_idx = 0; cur_idx < (int)zones.size(); cur_idx++) {
+      if (zones[cur_idx].type == MENU_TYPE_USB) {
+        menuItem = cur_idx;
+        printf("USB mounted, setting menu item to %d\n", menuItem);
+        break;
+      }
+    }
+  }
+#endif
+}
+
+void FunKeyMenu::refreshSystemState()
+{
+  systemStateTicket = commands.post("system_state", [this] { systemState.refresh(); return 0; });
+}
+
+/* takes in values of a background refresh once it landed, those the user already changed are kept.
+   Returns true if something shown changed */
+bool FunKeyMenu::pollSystemState()
+{
+  int status;
+  if (!systemStateTicket || !commands.result(systemStateTicket, status)) {
+    return false;
+  }
+  systemStateTicket = 0;
+
+  SystemSnapshot values;
+  bool stale;
+  if (!systemState.get(values, stale)) {
+    return false;
+  }
+
+  bool changed = false;
+#ifdef HAS_MENU_VOLUME
+  if (values.hasVolume && volume_percentage == initial_volume_percentage && values.volume != volume_percentage) {
+    volume_percentage = initial_volume_percentage = values.volume;
+    changed = true;
+  }
+#endif
+#ifdef HAS_MENU_BRIGHTNESS
+  if (values.hasBrightness && brightness_percentage == initial_brightness_percentage && values.brightness != brightness_percentage) {
+    brightness_percentage = initial_brightness_percentage = values.brightness;
+    changed = true;
+  }
+#endif
+#ifdef HAS_MENU_USB
+  if (values.usbDataConnected != usb_data_connected) {
+    usb_data_connected = values.usbDataConnected;
+    changed = true;
+  }
+#endif
+  return changed;
+}
+
+#ifdef HAS_MENU_VOLUME
+void FunKeyMenu::applyVolume(int percentage)
+{
+  systemState.setVolume(percentage);
+  commands.post(SHELL_CMD_VOLUME_SET, [percentage] {
+    return Platform::systemControl().setVolume(percentage) ? 0 : -1;
+  });
+}
+#endif
+
+#ifdef HAS_MENU_BRIGHTNESS
+void FunKeyMenu::applyBrightness(int percentage)
+{
+  systemState.setBrightness(percentage);
+  commands.post(SHELL_CMD_BRIGHTNESS_SET, [percentage] {
+    return Platform::systemControl().setBrightness(percentage) ? 0 : -1;
+  });
+}
+#endif
+
+void FunKeyMenu::persistSystemValues()
+{
+#ifdef HAS_MENU_VOLUME
+  if (volume_percentage != initial_volume_percentage) {
+    int percentage = volume_percentage;
+    commands.post("volume_persist", [percentage] {
+      return Platform::systemControl().persistVolume(percentage) ? 0 : -1;
+    });
+  }
+#endif
+#ifdef HAS_MENU_BRIGHTNESS
+  if (brightness_percentage != initial_brightness_percentage) {
+    int percentage = brightness_percentage;
+    commands.post("brightness_persist", [percentage] {
+      return Platform::systemControl().persistBrightness(percentage) ? 0 : -1;
+    });
+  }
+#endif
+}
+
+MenuRenderState FunKeyMenu::currentRenderState(SDL_Surface* screen, int menuItem, int prevItem, int scroll, uint8_t menu_confirmation, uint8_t menu_action)
+{
+  const FunKeyMenuEntry& zone = zones[menuItem];
+  MenuRenderState state = { screen, backgroundFor(screen, menuItem, scroll), menuItem, prevItem, scroll, menu_confirmation, menu_action, 0, 0, 0, 0, zone.revision };
+
+  if (zone.bar) {
+    state.bar = *zone.barValue;
+  }
+
+#if defined(HAS_MENU_SAVE) || defined(HAS_MENU_LOAD)
+  state.slot = savestate_slot * 2 + savestate_failed;
+  state.revision += saves.getRevision();
+#endif
+#ifdef HAS_MENU_ASPECT_RATIO
+  state.option = aspect_ratio;
+#endif
+#ifdef HAS_MENU_THEME
+  state.option = state.option * 256 + indexChooseLayout;
+#endif
+#ifdef HAS_MENU_RO_RW
+  state.toggle = read_write;
+#endif
+#ifdef HAS_MENU_USB
+  state.toggle = state.toggle * 2 + usb_sharing;
+#endif
+
+  return state;
+}
+
+/* area of the bars flipped between two values of the progress bar of a zone, if it has one */
+SDL_Rect FunKeyMenu::progressBarChangedRect(int menuItem, int oldPercentage, int newPercentage)
+{
+  SDL_Rect none = { 0, 0, 0, 0 };
+  const FunKeyMenuEntry& zone = zones[menuItem];
+  return zone.bar ? zone.bar->changedRect(oldPercentage, newPercentage) : none;
+}
+
+/* area of the zone covered by the info lines printed below the zone title */
+SDL_Rect FunKeyMenu::infoTextRect(SDL_Surface* screen)
+{
+  int line_height = MAX(TTF_FontHeight(fontTitle), TTF_FontHeight(fontInfo));
+  int top = screen->h - menu_layout.zoneHeight() + menu_layout.lineY(0, line_height);
+  int bottom = top + 2 * menu_layout.lineSpacing + line_height;
+#if defined(HAS_MENU_SAVE) || defined(HAS_MENU_LOAD)
+  /* slot thumbnails go below the last line */
+  bottom = MAX(bottom, screen->h - menu_layout.zoneHeight() + menu_layout.thumbnailY() + SaveStateService::THUMBNAIL_SIZE);
+#endif
+
+  SDL_Rect rect;
+  rect.x = (screen->w - menu_layout.zoneWidth()) / 2;
+  rect.y = MAX(top, 0);
+  rect.w = menu_layout.zoneWidth();
+  rect.h = MIN(bottom, screen->h) - rect.y;
+  return rect;
+}
+
+void FunKeyMenu::paintZones(SDL_Surface* screen, int menuItem, int prevItem, int scroll, uint8_t menu_confirmation, uint8_t menu_action)
+{
+  /// --------- Clear HW screen ----------
+  if (blitSurface(backgroundFor(screen, menuItem, scroll), NULL, screen, NULL)) {
+    MENU_ERROR_PRINTF("ERROR Could not Clear screen: %s\n", SDL_GetError());
+  }
+
+  /// --------- Setup Blit Window ----------
+  SDL_Rect menu_blit_window;
+  menu_blit_window.x = 0;
+  menu_blit_window.w = menu_layout.zoneWidth();
+
+  /// --------- Blit prev menu Zone going away ----------
+  menu_blit_window.y = scroll;
+  menu_blit_window.h = menu_layout.zoneHeight();
+  if (blitSurface(zones[prevItem].surface, &menu_blit_window, screen, NULL)) {
+    MENU_ERROR_PRINTF("ERROR Could not Blit surface on screen: %s\n", SDL_GetError());
+  }
+
+  /// --------- Blit new menu Zone going in (only during animations) ----------
+  if (scroll > 0) {
+    menu_blit_window.y = menu_layout.zoneHeight() - scroll;
+    menu_blit_window.h = menu_layout.zoneHeight();
+    if (blitSurface(zones[menuItem].surface, NULL, screen, &menu_blit_window)) {
+      MENU_ERROR_PRINTF("ERROR Could not Blit surface on screen: %s\n", SDL_GetError());
+    }
+  }
+  else if (scroll < 0) {
+    menu_blit_window.y = menu_layout.zoneHeight() + scroll;
+    menu_blit_window.h = menu_layout.zoneHeight();
+    if (blitSurface(zones[menuItem].surface, &menu_blit_window, screen, NULL)) {
+      MENU_ERROR_PRINTF("ERROR Could not Blit surface on screen: %s\n", SDL_GetError());
+    }
+  }
+  /// --------- No Scroll ? Blitting menu-specific info
+  else {
+    const FunKeyMenuEntry& zone = zones[menuItem];
+    if (zone.bar) {
+      zone.bar->draw(screen, *zone.barValue);
+    }
+    if (zone.render) {
+      zone.render(screen, menu_confirmation, menu_action);
+    }
+  }
+}
+
+void FunKeyMenu::paint(SDL_Surface* screen, int menuItem, int prevItem, int scroll, uint8_t menu_confirmation, uint8_t menu_action)
+{
+  /// --------- Vars ---------
+#ifdef HAS_MENU_USB
+  int print_arrows = (scroll || usb_sharing) ? 0 : 1;
+#else
+  int print_arrows = 1;
+#endif
+
+  /// --------- Scroll animation: one copy out of the precomposed strip ----------
+  if (scroll && scrollStrip.prepare(screen, zones[prevItem].surface, zones[menuItem].surface, prevItem, menuItem, scroll)) {
+    if (scrollStrip.blit(screen, backgroundFor(screen, menuItem, scroll), scroll)) {
+      MENU_ERROR_PRINTF("ERROR Could not Blit surface on screen: %s\n", SDL_GetError());
+    }
+  }
+  else {
+    paintZones(screen, menuItem, prevItem, scroll, menu_confirmation, menu_action);
+  }
+
+  /// --------- Print arrows --------
+  if (print_arrows) {
+    /// Both centered on a screen of another size than the compiled layout
+    int offset_y = (screen->h - menu_layout.screenHeight) / 2;
+
+    /// Top arrow
+    SDL_Rect pos_arrow_top;
+    pos_arrow_top.x = (screen->w - upArrow->w) / 2;
+    pos_arrow_top.y = offset_y + menu_layout.arrowTopY(upArrow->h);
+    blitSurface(upArrow, NULL, screen, &pos_arrow_top);
+
+    /// Bottom arrow
+    SDL_Rect pos_arrow_bottom;
+    pos_arrow_bottom.x = (screen->w - downArrow->w) / 2;
+    pos_arrow_bottom.y = offset_y + menu_layout.arrowBottomY(downArrow->h);
+    blitSurface(downArrow, NULL, screen, &pos_arrow_bottom);
+  }
+}
+
+void FunKeyMenu::refresh(SDL_Surface* screen, int menuItem, int prevItem, int scroll, uint8_t menu_confirmation, uint8_t menu_action)
+{
+  MENU_PROFILE_SCOPE(MENU_STAT_REFRESH);
+  MenuRenderState state = currentRenderState(screen, menuItem, prevItem, scroll, menu_confirmation, menu_action);
+
+  /// --------- Find out what changed since last frame ----------
+  if (!lastFrameValid || scroll || !state.sameZone(lastFrame)) {
+    damage.all();
+  }
+  else {
+    damage.clear();
+    if (!state.sameBar(lastFrame))
+      damage.add(progressBarChangedRect(menuItem, lastFrame.bar, state.bar));
+    if (!state.sameInfo(lastFrame))
+      damage.add(infoTextRect(screen));
+  }
+
+  lastFrame = state;
+  lastFrameValid = true;
+
+  /// --------- A flipped buffer is two frames behind ----------
+  presenter.age(screen, damage);
+
+  /// --------- Repaint ----------
+  if (damage.isFull()) {
+    paint(screen, menuItem, prevItem, scroll, menu_confirmation, menu_action);
+  }
+  else if (!damage.isEmpty()) {
+    /* every layer is painted again but clipped to the damaged area only */
+    for (size_t i = 0; i < damage.size(); ++i) {
+      SDL_SetClipRect(screen, &damage.data()[i]);
+      paint(screen, menuItem, prevItem, scroll, menu_confirmation, menu_action);
+    }
+    SDL_SetClipRect(screen, NULL);
+  }
+
+  /// --------- Flip or push damaged areas only ----------
+  presenter.present(screen, damage);
+}
+
+
+int FunKeyMenu::run(SDL_Surface* screen)
+{
+  if (!initCount) {
+    MENU_ERROR_PRINTF("FK_RunMenu called before FK_InitMenu\n");
+    return MENU_RETURN_ERROR;
+  }
+
+  setScreen(screen);
+
+  /// ------ The full menu takes over from the overlay ------
+  closeOverlay();
+
+  MENU_DEBUG_PRINTF("Run Menu\n");
+
+  /// ------ Open latency: from here to the first frame on screen ------
+  MENU_PROFILE_BEGIN(open_timer, MENU_STAT_OPEN);
+
+  /// ------ Only blocks if resources are still being preloaded ------
+  waitPreload();
+  if (zones.empty()) {
+    MENU_ERROR_PRINTF("No menu zone to show\n");
+    return MENU_RETURN_ERROR;
+  }
+
+  int scroll = 0;
+  int start_scroll = 0;
+  uint8_t screen_refresh = 1;
+  bool keep_screen = false;
+  menu_confirmation = 0;
+  stop_menu_loop = 0;
+#ifdef HAS_MENU_THEME
+  indexChooseLayout = config->currentLayoutIdx_;
+#endif
+  int returnCode = MENU_RETURN_OK;
+
+  /// ------ Get System values -------
+  initSystemValues();
+  int prevItem = menuItem;
+
+  /// Save prev key repeat params and set new Key repeat
+  SDL_GetKeyRepeat(&backup_key_repeat_delay, &backup_key_repeat_interval);
+  if (SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL)) {
+    MENU_ERROR_PRINTF("ERROR with SDL_EnableKeyRepeat: %s\n", SDL_GetError());
+  }
+
+#if defined(HAS_MENU_SAVE) || defined(HAS_MENU_LOAD)
+  /// Get save slot from game
+  savestate_slot = (savestate_slot % MAX_SAVE_SLOTS); // security
+  savestate_failed = 0;
+#endif
+
+  /// ------ Backup currently displayed app screen -------
+  background_screen = captureBackground(screen);
+  if (background_screen == NULL) {
+    return MENU_RETURN_ERROR;
+  }
+#ifdef HAS_MENU_ASPECT_RATIO
+  aspectPreview.setFrame(hostSourceFrame ? hostSourceFrame : background_screen);
+#endif
+  hostSourceFrame = nullptr;
+  invalidateFrame();
+
+  /// ------ Wake up when a background command completes -------
+  loopRunning = true;
+  commands.setNotifier(FunKeyMenu::wakeUp);
+  pacer.reset();
+  input.reset();
+
+  /// -------- Main loop ---------
+  while (!stop_menu_loop)
+  {
+    /// -------- Nothing to animate: sleep until an event shows up ---------
+    if (!scroll && !start_scroll && !screen_refresh && !input.hasPendingMove()) {
+      /// -------- Idle is also when zones next to the shown one are built and cold ones freed ---------
+      prefetchZones();
+      trimZones(1);
+      SDL_WaitEvent(NULL);
+      pacer.reset();
+    }
+
+    /// -------- Handle input, drained once per frame ---------
+    bool moved = false;
+    for (const MenuInput::Action& action : input.poll(scroll != 0)) {
+      switch (action.type)
+      {
+      case MenuInput::ACTION_QUIT:
+        stop_menu_loop = 1;
+        returnCode = MENU_RETURN_EXIT;
+        break;
+
+      case MenuInput::ACTION_BACK:
+        if (menu_confirmation) {
+          /// ------ Reset menu confirmation ------
+          menu_confirmation = 0;
+          /// ------ Refresh screen ------
+          screen_refresh = 1;
+        }
+        break;
+
+      case MenuInput::ACTION_CLOSE:
+        /// ------ Check if no action ------
+#ifdef HAS_MENU_USB
+        if (usb_sharing) {
+          break;
+        }
+#endif
+        stop_menu_loop = 1;
+        break;
+
+      case MenuInput::ACTION_MOVE:
+      {
+        MENU_DEBUG_PRINTF("%s\n", action.value > 0 ? "DOWN" : "UP");
+        /// ------ Check if no action ------
+#ifdef HAS_MENU_USB
+        if (usb_sharing) {
+          break;
+        }
+#endif
+        /// ------ One scroll at a time, a further move starts once it is over ------
+        if (moved) {
+          input.deferMove(action.value);
+          break;
+        }
+        moved = true;
+
+        /// ------ Start scrolling to new menu, skipping the USB one if not connected -------
+        menuItem = nextZone(menuItem, action.value);
+        start_scroll = action.value;
+
+        /// ------ Reset menu confirmation ------
+        menu_confirmation = 0;
+
+        /// ------ Refresh screen ------
+        screen_refresh = 1;
+        break;
+      }
+
+      case MenuInput::ACTION_ZONE:
+      {
+        /// ------ Keys after a move would land on the zone scrolling in ------
+        if (moved) {
+          break;
+        }
+
+        /// ------ A merged burst is handed over as its net delta and repaints once ------
+        int result = handleZoneKey(action.key, action.value);
+        if (result & MENU_ZONE_REFRESH) {
+          screen_refresh = 1;
+        }
+        if (result & (MENU_ZONE_CLOSE | MENU_ZONE_EXIT)) {
+          stop_menu_loop = 1;
+          keep_screen = (result & MENU_ZONE_KEEP_SCREEN) != 0;
+          if (result & MENU_ZONE_EXIT) {
+            returnCode = MENU_RETURN_EXIT;
+          }
+        }
+        break;
+      }
+      }
+
+      /// ------ Whatever comes after leaving the menu is dropped ------
+      if (stop_menu_loop) {
+        break;
+      }
+    }
+
+    /// --------- Zone scrolled to is normally prefetched, its own neighbours are built before the scroll animates ---------
+    if (start_scroll) {
+      prefetchZones();
+    }
+    else {
+      materializeZone(menuItem);
+    }
+
+#ifdef HAS_MENU_RO_RW
+    /// --------- Read back pending RO/RW command ---------
+    if (pollRemount(false)) {
+      screen_refresh = 1;
+    }
+
+    /// --------- Mount state again once the remount from init is done ---------
+    int mount_status;
+    if (mountTicket && commands.result(mountTicket, mount_status)) {
+      int mounted = Platform::mountState(RO_RW_MOUNT_POINT);
+      if (mounted >= 0 && !ro_rw_ticket) {
+        read_write = mounted;
+      }
+      mountTicket = 0;
+      screen_refresh = 1;
+    }
+#endif
+
+    /// --------- Values refreshed in background since the menu opened ---------
+    if (pollSystemState()) {
+      screen_refresh = 1;
+    }
+
+    /// --------- Handle Scroll effect ---------
+    if ((scroll > 0) || (start_scroll > 0)) {
+      scroll += menu_layout.scrollStep(scroll);
+      start_scroll = 0;
+      screen_refresh = 1;
+    }
+    else if ((scroll < 0) || (start_scroll < 0)) {
+      scroll -= menu_layout.scrollStep(-scroll);
+      start_scroll = 0;
+      screen_refresh = 1;
+    }
+    if (scroll >= menu_layout.zoneHeight() || scroll <= -menu_layout.zoneHeight()) {
+      prevItem = menuItem;
+      scroll = 0;
+      screen_refresh = 1;
+    }
+
+    /// --------- Handle FPS ---------
+    pacer.wait();
+
+    /// --------- Refresh screen
+    if (screen_refresh) {
+#ifdef HAS_MENU_RO_RW
+      refresh(screen, menuItem, prevItem, scroll, menu_confirmation, ro_rw_ticket && zones[menuItem].type == MENU_TYPE_RO_RW);
+#else
+      refresh(screen, menuItem, prevItem, scroll, menu_confirmation, 0);
+#endif
+      MENU_PROFILE_END(open_timer);
+    }
+
+    /// --------- reset screen refresh ---------
+    screen_refresh = 0;
+
+    /// --------- Let the host script input or sample state ---------
+    if (frameCallback) {
+      frameCallback(scroll || start_scroll, frameCallbackData);
+    }
+  }
+
+  commands.setNotifier(nullptr);
+  loopRunning = false;
+  flushWakeUps();
+
+#ifdef HAS_MENU_RO_RW
+  /// ------ Take in a remount done meanwhile, one still running is read back at next open or at end ------
+  pollRemount(false);
+#endif
+
+  /// ------ Closed: the emulator gets back everything over budget ------
+  trimZones(0);
+
+  /// ------ Save changed system values -------
+  persistSystemValues();
+
+  /// ------ Reset prev key repeat params -------
+  if (SDL_EnableKeyRepeat(backup_key_repeat_delay, backup_key_repeat_interval)) {
+    MENU_ERROR_PRINTF("ERROR with SDL_EnableKeyRepeat: %s\n", SDL_GetError());
+  }
+
+  /// --------- Clear HW screen ----------
+  if (!keep_screen) {
+    if (blitSurface(background_screen, NULL, screen, NULL)) {
+      MENU_ERROR_PRINTF("ERROR Could not Clear screen: %s\n", SDL_GetError());
+    }
+
+    /// --------- Flip Screen ----------
+    SDL_Flip(screen);
+  }
+
+  /// --------- Background is owned by the menu or the host, just drop it ----------
+  background_screen = NULL;
+#ifdef HAS_MENU_ASPECT_RATIO
+  aspectPreview.release();
+#endif
+  MENU_DEBUG_PRINTF("Leave Menu\n");
+  return returnCode;
+}
+
+/// -------------- OVERLAY --------------
+
+/* the zone square, where the overlay is blended */
+SDL_Rect FunKeyMenu::overlayRect(SDL_Surface* screen) const
+{
+  SDL_Rect rect;
+  rect.w = MIN(menu_layout.squareWidth, screen->w);
+  rect.h = MIN(menu_layout.squareHeight, screen->h);
+  rect.x = (screen->w - rect.w) / 2;
+  rect.y = (screen->h - rect.h) / 2;
+  return rect;
+}
+
+int FunKeyMenu::openOverlay(int type)
+{
+  if (!initCount) {
+    MENU_ERROR_PRINTF("FK_MenuOpenOverlay called before FK_InitMenu\n");
+    return -1;
+  }
+
+  waitPreload();
+  if (!overlayOpen) {
+    initSystemValues();
+  }
+
+  /// ------ Requested zone, or the last one shown ------
+  int item = -1;
+  for (int i = 0; i < (int)zones.size() && item < 0; i++) {
+    if (isOverlayZone(i) && (type < 0 ? i == menuItem : zones[i].type == type)) {
+      item = i;
+    }
+  }
+  for (int i = 0; i < (int)zones.size() && item < 0 && type < 0; i++) {
+    if (isOverlayZone(i)) {
+      item = i;
+    }
+  }
+  if (item < 0 || !materializeZone(item)) {
+    MENU_ERROR_PRINTF("No menu zone to show over the game\n");
+    return -1;
+  }
+
+  menuItem = item;
+  menu_confirmation = 0;
+  overlayOpen = true;
+  overlayDirty = true;
+  overlayDeadline = SDL_GetTicks() + OVERLAY_TIMEOUT_MS;
+  MENU_DEBUG_PRINTF("Open Menu overlay\n");
+  return 0;
+}
+
+void FunKeyMenu::closeOverlay()
+{
+  if (!overlayOpen) {
+    return;
+  }
+
+  overlayOpen = false;
+  persistSystemValues();
+  trimZones(0);
+  SDL_FreeSurface(overlaySurface);
+  overlaySurface = NULL;
+  MENU_DEBUG_PRINTF("Close Menu overlay\n");
+}
+
+bool FunKeyMenu::handleOverlayEvent(const SDL_Event& event)
+{
+  if (!overlayOpen || event.type != SDL_KEYDOWN) {
+    return false;
+  }
+
+  SDLKey key = MenuInput::translate(event.key.keysym.sym);
+  switch (key)
+  {
+  case SDLK_ESCAPE:
+    closeOverlay();
+    return true;
+
+  case SDLK_UP:
+  case SDLK_DOWN:
+  {
+    /// ------ Next adjustment, without animation ------
+    int count = (int)zones.size();
+    int step = key == SDLK_DOWN ? 1 : -1;
+    int item = menuItem;
+    do {
+      item = (item + step + count) % count;
+    } while (item != menuItem && !isOverlayZone(item));
+
+    if (item != menuItem && materializeZone(item)) {
+      menuItem = item;
+      overlayDirty = true;
+    }
+    break;
+  }
+
+  case SDLK_LEFT:
+  case SDLK_RIGHT:
+    if (handleZoneKey(key) & MENU_ZONE_REFRESH) {
+      overlayDirty = true;
+    }
+    break;
+
+  default:
+    return false;
+  }
+
+  overlayDeadline = SDL_GetTicks() + OVERLAY_TIMEOUT_MS;
+  return true;
+}
+
+bool FunKeyMenu::updateOverlay()
+{
+  if (overlayOpen && pollSystemState()) {
+    overlayDirty = true;
+  }
+  if (overlayOpen && (Sint32)(SDL_GetTicks() - overlayDeadline) >= 0) {
+    closeOverlay();
+  }
+  return overlayOpen;
+}
+
+/* zone with its current values as a screen-sized ARGB surface, only the zone square is drawn and made translucent */
+bool FunKeyMenu::composeOverlay(SDL_Surface* screen)
+{
+  if (overlaySurface && (overlaySurface->w != screen->w || overlaySurface->h != screen->h)) {
+    SDL_FreeSurface(overlaySurface);
+    overlaySurface = NULL;
+  }
+  if (!overlaySurface) {
+    overlaySurface = SDL_CreateRGBSurface(SDL_SWSURFACE, screen->w, screen->h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    if (!overlaySurface) {
+      MENU_ERROR_PRINTF("ERROR Could not create overlay surface: %s\n", SDL_GetError());
+      return false;
+    }
+  }
+
+  FunKeyMenuEntry& zone = zones[menuItem];
+  SDL_Rect area = overlayRect(screen);
+  SDL_SetClipRect(overlaySurface, &area);
+
+  /// --------- Raw copy of the zone, so that its own transparency is kept ----------
+  Uint32 flags = zone.surface->flags & (SDL_SRCALPHA | SDL_RLEACCEL);
+  Uint8 alpha = zone.surface->format->alpha;
+  SDL_SetAlpha(zone.surface, 0, alpha);
+  SDL_Rect pos = area;
+  if (blitSurface(zone.surface, &area, overlaySurface, &pos)) {
+    MENU_ERROR_PRINTF("ERROR Could not Blit surface on overlay: %s\n", SDL_GetError());
+  }
+  SDL_SetAlpha(zone.surface, flags, alpha);
+
+  /// --------- Values drawn as in the menu ----------
+  if (zone.bar) {
+    zone.bar->draw(overlaySurface, *zone.barValue);
+  }
+  if (zone.render) {
+    zone.render(overlaySurface, 0, 0);
+  }
+  SDL_SetClipRect(overlaySurface, NULL);
+
+  /// --------- Let the game show through ----------
+  SDL_LockSurface(overlaySurface);
+  for (int y = area.y; y < area.y + area.h; y++) {
+    uint32_t* row = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(overlaySurface->pixels) + y * overlaySurface->pitch);
+    for (int x = area.x; x < area.x + area.w; x++) {
+      uint32_t a = row[x] >> 24;
+      row[x] = (row[x] & 0x00FFFFFF) | ((a * OVERLAY_ALPHA / 255) << 24);
+    }
+  }
+  SDL_UnlockSurface(overlaySurface);
+  SDL_SetAlpha(overlaySurface, SDL_SRCALPHA, SDL_ALPHA_OPAQUE);
+  return true;
+}
+
+void FunKeyMenu::compositeOverlay(SDL_Surface* screen)
+{
+  if (!overlayOpen) {
+    return;
+  }
+
+  MENU_PROFILE_SCOPE(MENU_STAT_REFRESH);
+  if (overlayDirty || !overlaySurface || overlaySurface->w != screen->w || overlaySurface->h != screen->h) {
+    if (!composeOverlay(screen)) {
+      return;
+    }
+    overlayDirty = false;
+  }
+
+  /// --------- Only the zone square is blended onto the game frame ----------
+  SDL_Rect area = overlayRect(screen);
+  SDL_Rect pos = area;
+  if (blitSurface(overlaySurface, &area, screen, &pos)) {
+    MENU_ERROR_PRINTF("ERROR Could not Blit overlay on screen: %s\n", SDL_GetError());
+  }
+}
+
+
+/// -------------- C API --------------
+
+/* menu behind the handle-less calls, its screen is given to FK_RunMenu. Menus created with FK_InitMenu(fkmenu_t&) are separate */
+static FunKeyMenu menu(nullptr);
+
+#ifdef HAS_MENU_THEME
+void FK_InitMenu(Configuration& c)
+{
+  menu.init(c);
+}
+#else
+void FK_InitMenu(void)
+{
+  menu.init();
+}
+#endif
+
+#ifdef HAS_MENU_THEME
+void FK_InitMenuAsync(Configuration& c)
+{
+  menu.init(c, true);
+}
+#else
+void FK_InitMenuAsync(void)
+{
+  menu.init(true);
+}
+#endif
+
+void FK_EndMenu(void)
+{
+  menu.end();
+}
+
+int FK_RunMenu(SDL_Surface* screen)
+{
+  return menu.run(screen);
+}
+
+void FK_StopMenu(void)
+{
+  menu.stop();
+}
+
+int FK_MenuOpenOverlay(int menu_type)
+{
+  return menu.openOverlay(menu_type);
+}
+
+void FK_MenuCloseOverlay(void)
+{
+  menu.closeOverlay();
+}
+
+int FK_MenuHandleEvent(const SDL_Event* event)
+{
+  return event && menu.handleOverlayEvent(*event) ? 1 : 0;
+}
+
+int FK_MenuUpdate(void)
+{
+  return menu.updateOverlay() ? 1 : 0;
+}
+
+void FK_MenuComposite(SDL_Surface* screen)
+{
+  menu.compositeOverlay(screen);
+}
+
+void FK_SetMenuBackground(SDL_Surface* frame)
+{
+  menu.hostBackground = frame;
+}
+
+void FK_SetMenuSourceFrame(SDL_Surface* frame)
+{
+  menu.hostSourceFrame = frame;
+}
+
+void FK_SetMenuFPS(int fps)
+{
+  menu.pacer.setFps(fps);
+}
+
+void FK_SetMenuFrameCallback(FK_MenuFrameCallback callback, void* userdata)
+{
+  menu.frameCallback = callback;
+  menu.frameCallbackData = userdata;
+}
+
+#ifdef HAS_MENU_ASPECT_RATIO
+int FK_GetAspectRatio(void)
+{
+  return menu.getAspectRatio();
+}
+
+int FK_GetAspectRatioFactor(void)
+{
+  return menu.getAspectRatioFactor();
+}
+
+void FK_SetAspectRatio(int aspect_ratio, int factor_percent)
+{
+  menu.setAspectRatio(aspect_ratio, factor_percent);
+}
+#endif
+
+int FK_GetMenuStats(FK_MenuStat* stats, int nb_stats)
+{
+#ifdef MENU_PROFILE
+  nb_stats = MIN(nb_stats, (int)NB_MENU_STATS);
+  for (int i = 0; i < nb_stats; i++) {
+    MenuProfiler::get(i, stats[i]);
+  }
+  return MAX(nb_stats, 0);
+#else
+  (void)stats;
+  (void)nb_stats;
+  return 0;
+#endif
+}
+
+void FK_ResetMenuStats(void)
+{
+#ifdef MENU_PROFILE
+  MenuProfiler::reset();
+#endif
+}
+
+int FK_AddMenuZone(const FK_MenuZone* zone)
+{
+  return zone ? menu.addCustomZone(*zone) : -1;
+}
+
+int FK_GetMenuZoneIndex(int menu_type)
+{
+  return menu.zoneIndex(menu_type);
+}
+
+void FK_SetMenuZoneCache(const char* path)
+{
+  menu.setZoneCache(path ? path : "");
+}
+
+void FK_SetMenuSystemStateFreshness(int ms)
+{
+  menu.setSystemStateFreshness(ms);
+}
+
+void FK_SetMenuZoneBudget(int max_zones)
+{
+  menu.setZoneBudget(max_zones);
+}
+
+void FK_SetSaveStateService(const char* path, const FK_SaveStateCallbacks* callbacks)
+{
+  menu.setSaveStateService(path ? path : "", callbacks);
+}
+
+void FK_SetSaveStateDeltas(int consolidate_percent)
+{
+  menu.setSaveStateDeltas(consolidate_percent);
+}
+
+int FK_LoadQuickSaveState(void)
+{
+  return menu.loadQuickState();
+}
+
+int FK_WriteSaveStream(FK_SaveStream* stream, const void* data, size_t size)
+{
+  return stream && stream->write(data, size) ? 0 : -1;
+}
+
+int FK_ReadSaveStream(FK_SaveStream* stream, void* data, size_t size)
+{
+  return stream && stream->read(data, size) ? 0 : -1;
+}
+
+int FK_ExportMenuResourceBundle(const char* path)
+{
+  return FunKeyMenu::exportResources(path ? path : Platform::resourcePath() + MENU_RESOURCE_BUNDLE) ? 0 : -1;
+}
+
+
+/// -------------- HANDLE API --------------
+
+static FunKeyMenu* menu_from_handle(fkmenu_t handle)
+{
+  return reinterpret_cast<FunKeyMenu*>(static_cast<uintptr_t>(handle));
+}
+
+#ifdef HAS_MENU_THEME
+void FK_InitMenu(fkmenu_t& handle, Configuration& c, SDL_Surface* screen)
+#else
+void FK_InitMenu(fkmenu_t& handle, SDL_Surface* screen)
+#endif
+{
+  FunKeyMenu* menu = new FunKeyMenu(screen);
+#ifdef HAS_MENU_THEME
+  menu->init(c);
+#else
+  menu->init();
+#endif
+  handle = reinterpret_cast<uintptr_t>(menu);
+}
+
+#ifdef HAS_MENU_THEME
+void FK_InitMenuAsync(fkmenu_t& handle, Configuration& c, SDL_Surface* screen)
+#else
+void FK_InitMenuAsync(fkmenu_t& handle, SDL_Surface* screen)
+#endif
+{
+  FunKeyMenu* menu = new FunKeyMenu(screen);
+#ifdef HAS_MENU_THEME
+  menu->init(c, true);
+#else
+  menu->init(true);
+#endif
+  handle = reinterpret_cast<uintptr_t>(menu);
+}
+
+void FK_EndMenu(fkmenu_t& handle)
+{
+  FunKeyMenu* menu = menu_from_handle(handle);
+  if (menu) {
+    menu->end();
+    delete menu;
+  }
+  handle = 0;
+}
+
+int FK_RunMenu(fkmenu_t handle, SDL_Surface* screen)
+{
+  return menu_from_handle(handle)->run(screen);
+}
+
+void FK_StopMenu(fkmenu_t handle)
+{
+  menu_from_handle(handle)->stop();
+}
+
+int FK_MenuOpenOverlay(fkmenu_t handle, int menu_type)
+{
+  return menu_from_handle(handle)->openOverlay(menu_type);
+}
+
+void FK_MenuCloseOverlay(fkmenu_t handle)
+{
+  menu_from_handle(handle)->closeOverlay();
+}
+
+int FK_MenuHandleEvent(fkmenu_t handle, const SDL_Event* event)
+{
+  return event && menu_from_handle(handle)->handleOverlayEvent(*event) ? 1 : 0;
+}
+
+int FK_MenuUpdate(fkmenu_t handle)
+{
+  return menu_from_handle(handle)->updateOverlay() ? 1 : 0;
+}
+
+void FK_MenuComposite(fkmenu_t handle, SDL_Surface* screen)
+{
+  menu_from_handle(handle)->compositeOverlay(screen);
+}
+
+void FK_SetMenuBackground(fkmenu_t handle, SDL_Surface* frame)
+{
+  menu_from_handle(handle)->hostBackground = frame;
+}
+
+void FK_SetMenuSourceFrame(fkmenu_t handle, SDL_Surface* frame)
+{
+  menu_from_handle(handle)->hostSourceFrame = frame;
+}
+
+void FK_SetMenuFPS(fkmenu_t handle, int fps)
+{
+  menu_from_handle(handle)->pacer.setFps(fps);
+}
+
+void FK_SetMenuFrameCallback(fkmenu_t handle, FK_MenuFrameCallback callback, void* userdata)
+{
+  menu_from_handle(handle)->frameCallback = callback;
+  menu_from_handle(handle)->frameCallbackData = userdata;
+}
+
+#ifdef HAS_MENU_ASPECT_RATIO
+int FK_GetAspectRatio(fkmenu_t handle)
+{
+  return menu_from_handle(handle)->getAspectRatio();
+}
+
+int FK_GetAspectRatioFactor(fkmenu_t handle)
+{
+  return menu_from_handle(handle)->getAspectRatioFactor();
+}
+
+void FK_SetAspectRatio(fkmenu_t handle, int aspect_ratio, int factor_percent)
+{
+  menu_from_handle(handle)->setAspectRatio(aspect_ratio, factor_percent);
+}
+#endif
+
+int FK_AddMenuZone(fkmenu_t handle, const FK_MenuZone* zone)
+{
+  return zone ? menu_from_handle(handle)->addCustomZone(*zone) : -1;
+}
+
+int FK_GetMenuZoneIndex(fkmenu_t handle, int menu_type)
+{
+  return menu_from_handle(handle)->zoneIndex(menu_type);
+}
+
+void FK_SetMenuZoneCache(fkmenu_t handle, const char* path)
+{
+  menu_from_handle(handle)->setZoneCache(path ? path : "");
+}
+
+void FK_SetMenuSystemStateFreshness(fkmenu_t handle, int ms)
+{
+  menu_from_handle(handle)->setSystemStateFreshness(ms);
+}
+
+void FK_SetMenuZoneBudget(fkmenu_t handle, int max_zones)
+{
+  menu_from_handle(handle)->setZoneBudget(max_zones);
+}
+
+void FK_SetSaveStateService(fkmenu_t handle, const char* path, const FK_SaveStateCallbacks* callbacks)
+{
+  menu_from_handle(handle)->setSaveStateService(path ? path : "", callbacks);
+}
+
+void FK_SetSaveStateDeltas(fkmenu_t handle, int consolidate_percent)
+{
+  menu_from_handle(handle)->setSaveStateDeltas(consolidate_percent);
+}
+
+int FK_LoadQuickSaveState(fkmenu_t handle)
+{
+  return menu_from_handle(handle)->loadQuickState();
+}
@@ -52,6 +52,16 @@ extern "C" {
 #define HAS_MENU_POWERDOWN
 #define HAS_MENU_RO_RW
 
+/* target screen, the menu layout is derived from it at compile time. May be set by the build */
+#ifndef FK_MENU_SCREEN_WIDTH
+#define FK_MENU_SCREEN_WIDTH        240
+#endif
+#ifndef FK_MENU_SCREEN_HEIGHT
+#define FK_MENU_SCREEN_HEIGHT       240
+#endif
+/* the build may also set FK_MENU_ZONE_LIST to the comma separated ENUM_MENU_TYPE shown, in order. Types not
+   enabled above are skipped, the default shows all enabled ones */
+
   typedef enum {
     MENU_TYPE_VOLUME,
     MENU_TYPE_BRIGHTNESS,
@@ -67,6 +77,65 @@ extern "C" {
     NB_MENU_TYPES,
   } ENUM_MENU_TYPE;
 
+  ////------ Zones added by the host ------
+#define MAX_CUSTOM_MENU_ZONES       8
+
+  typedef enum {
+    MENU_ZONE_IGNORED = 0,
+    MENU_ZONE_REFRESH = 1 << 0,       /* zone content changed and must be painted again */
+    MENU_ZONE_CONFIRM = 1 << 1,       /* asks for confirmation, next SDLK_RETURN comes confirmed */
+    MENU_ZONE_CLOSE = 1 << 2,         /* leaves the menu, FK_RunMenu returns MENU_RETURN_OK */
+    MENU_ZONE_EXIT = 1 << 3,          /* leaves the menu, FK_RunMenu returns MENU_RETURN_EXIT */
+    MENU_ZONE_KEEP_SCREEN = 1 << 4,   /* along with CLOSE or EXIT, the last menu frame stays on screen */
+  } ENUM_MENU_ZONE_RESULT;
+
+  typedef struct {
+    const char* caption;              /* drawn one line above the zone center, may be NULL */
+    /* optional, draws static content on the zone surface once */
+    void (*compose)(SDL_Surface* zone, void* userdata);
+    /* optional, draws over the zone while it is shown, action is set while a confirmed SDLK_RETURN runs */
+    void (*render)(SDL_Surface* screen, int confirmation, int action, void* userdata);
+    /* optional, gets SDLK_LEFT, SDLK_RIGHT or SDLK_RETURN and returns ENUM_MENU_ZONE_RESULT flags */
+    int (*on_key)(SDLKey key, int confirmation, void* userdata);
+    int shows_action;                 /* paints the zone with action set before on_key runs a confirmed SDLK_RETURN */
+    void* userdata;
+  } FK_MenuZone;
+
+  ////------ Save states written and read by the menu for the host ------
+  typedef struct FK_SaveStream FK_SaveStream;
+
+  typedef struct {
+    /* writes the whole state with FK_WriteSaveStream, returns 0 on success */
+    int (*serialize)(FK_SaveStream* stream, void* userdata);
+    /* reads the whole state back with FK_ReadSaveStream, returns 0 on success */
+    int (*deserialize)(FK_SaveStream* stream, void* userdata);
+    void* userdata;
+  } FK_SaveStateCallbacks;
+
+  ////------ Profiling counters, only fed when built with MENU_PROFILE ------
+  typedef enum {
+    MENU_STAT_INIT,
+    MENU_STAT_PRELOAD,
+    MENU_STAT_SYSTEM_VALUES,
+    MENU_STAT_OPEN,
+    MENU_STAT_REFRESH,
+    MENU_STAT_BLIT,
+    MENU_STAT_TEXT,
+    MENU_STAT_SHELL,
+    NB_MENU_STATS,
+  } ENUM_MENU_STATS;
+
+  typedef struct {
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t max_us;
+    uint32_t p99_us;
+    uint64_t bytes;     /* pixel data written, only tracked for blits */
+  } FK_MenuStat;
+
+  /* animating is set while a zone scroll is in progress, which ignores input */
+  typedef void (*FK_MenuFrameCallback)(int animating, void* userdata);
+
   typedef enum {
     MENU_RETURN_OK,
     MENU_RETURN_EXIT,
@@ -124,29 +193,172 @@ extern "C" {
 #ifdef HAS_MENU_RO_RW
 #define SHELL_CMD_RO                        "ro"
 #define SHELL_CMD_RW                        "rw"
+#define RO_RW_MOUNT_POINT                   "/"
+#define PROC_MOUNTS_PATH                    "/proc/mounts"
 #endif
 
+////------ Direct system control -------
+#define SYSFS_BACKLIGHT_PATH                "/sys/class/backlight/backlight/"
+#define ALSA_MIXER_CARD                     "default"
+#define ALSA_MIXER_ELEMENT                  "Headphone"
+/* when set in the environment volume and brightness are only kept in memory */
+#define MENU_ENV_DETACHED_SYSTEM_CONTROL    "FK_MENU_DETACHED_SYSTEM_CONTROL"
+
+////------ Resources -------
+#define MENU_RESOURCE_BUNDLE                "menu_resources.bundle"
+
+  /* prepares fonts, images and zones once, further calls only take a reference and return right away */
 #ifdef HAS_MENU_THEME
   extern void FK_InitMenu(Configuration& c);
 #else
   extern void FK_InitMenu(void);
 #endif
+  /* like FK_InitMenu but fonts, images and zones are prepared on a background thread, FK_RunMenu only blocks
+     if they are not ready yet. TTF is set up by the calling thread, which must not open fonts until then */
+#ifdef HAS_MENU_THEME
+  extern void FK_InitMenuAsync(Configuration& c);
+#else
+  extern void FK_InitMenuAsync(void);
+#endif
+  /* drops a reference, resources are released with the last one */
   extern void FK_EndMenu(void);
+  /* opens the menu over the current content of screen, FK_InitMenu must have been called before */
   extern int FK_RunMenu(SDL_Surface* screen);
   extern void FK_StopMenu(void);
 
-  /* Ends C function definitions when using C++ */
+  /* menu drawn over the running game instead of a frozen copy of it, for adjustments which should not stop it.
+     Only zones with a progress bar are shown, starting on the one of type menu_type, an ENUM_MENU_TYPE, or on the
+     last one shown if -1. The host keeps its loop and, once per frame, gives every event to FK_MenuHandleEvent,
+     calls FK_MenuUpdate and composites the zone with FK_MenuComposite. Returns 0 on success, -1 otherwise */
+  extern int FK_MenuOpenOverlay(int menu_type);
+  extern void FK_MenuCloseOverlay(void);
+  /* returns 1 if the overlay used the event, which should then not reach the game */
+  extern int FK_MenuHandleEvent(const SDL_Event* event);
+  /* returns 1 while the overlay is open, it closes by itself a while after the last key or with SDLK_q */
+  extern int FK_MenuUpdate(void);
+  /* blends the zone onto the frame the game drew on screen, to be called right before the host flips it */
+  extern void FK_MenuComposite(SDL_Surface* screen);
 
-  typedef int64_t fkmenu_t;
+  /* sets the rate of menu animations, the menu sleeps while idle whatever the rate, <= 0 disables pacing */
+  extern void FK_SetMenuFPS(int fps);
+
+  /* called by FK_RunMenu at the end of each iteration of its loop, e.g. to script input, NULL to disable */
+  extern void FK_SetMenuFrameCallback(FK_MenuFrameCallback callback, void* userdata);
+
+#ifdef HAS_MENU_ASPECT_RATIO
+  /* aspect ratio picked in the menu, an ENUM_ASPECT_RATIOS_TYPES, and zoom of ASPECT_RATIOS_TYPE_MANUAL in percent.
+     FK_ScaleSurface follows them on its own */
+  extern int FK_GetAspectRatio(void);
+  extern int FK_GetAspectRatioFactor(void);
+  /* e.g. to restore the settings of the game */
+  extern void FK_SetAspectRatio(int aspect_ratio, int factor_percent);
+#endif
+
+  /* hands over the last frame rendered by the host, to be used by next FK_RunMenu as menu background instead of
+     a copy of the screen. It must be screen-sized, opaque, distinct from the screen and left untouched until
+     FK_RunMenu returns */
+  extern void FK_SetMenuBackground(SDL_Surface* frame);
+
+  /* hands over the unscaled frame of the game, to be previewed by next FK_RunMenu in each aspect ratio instead of
+     the menu background. It must be left untouched until FK_RunMenu returns */
+  extern void FK_SetMenuSourceFrame(SDL_Surface* frame);
 
-  /* inits a new menu and returns a handle to manage it */
-  //extern void FK_InitMenu(fkmenu_t& handle);
+  /* fills up to nb_stats counters indexed by ENUM_MENU_STATS, returns how many or 0 if built without MENU_PROFILE */
+  extern int FK_GetMenuStats(FK_MenuStat* stats, int nb_stats);
+  extern void FK_ResetMenuStats(void);
 
-  /* releases all menu resources */
-  //extern void FK_StopMenu(fkmenu_t& handle);
-  
+  /* appends a zone after the built-in ones, the menu must be initialized. Returns its index or -1, e.g. once
+     MAX_CUSTOM_MENU_ZONES were added. Added zones are kept by later FK_EndMenu and FK_InitMenu cycles */
+  extern int FK_AddMenuZone(const FK_MenuZone* zone);
+
+  /* index of the zone of an ENUM_MENU_TYPE as shown by the initialized menu, or -1 if it is not shown */
+  extern int FK_GetMenuZoneIndex(int menu_type);
+
+  /* enables caching the composed menu zones to path, or disables it if NULL. FK_InitMenu then loads them from
+     the file unless resources, enabled zones or screen format changed, an initialized menu does so right away.
+     Zones are all composed while it is enabled, instead of on their first visit */
+  extern void FK_SetMenuZoneCache(const char* path);
+
+  /* frees the surfaces of the zones farthest from the one shown once more than max_zones are built, 0 keeps them
+     all. The zone shown and its neighbours are always kept while the menu runs */
+  extern void FK_SetMenuZoneBudget(int max_zones);
+
+  /* system values (volume, brightness, ...) read less than ms ago are shown as is when the menu opens, older ones
+     too but they are read again in background and updated once known. <= 0 reads them again on each opening */
+  extern void FK_SetMenuSystemStateFreshness(int ms);
+
+  /* makes SAVE and LOAD run the state I/O themselves instead of only closing the menu. States of slot n go to
+     <path>.<n> and an index of the slots, with their date and a thumbnail shown by the slot picker, to
+     <path>.index. EXIT APP saves to <path>.quick before leaving. The callbacks run on the calling thread while
+     the file is streamed on a background one, a save may still be flushing once FK_RunMenu returned.
+     NULL callbacks disable it */
+  extern void FK_SetSaveStateService(const char* path, const FK_SaveStateCallbacks* callbacks);
+
+  /* saves only the pages changed since the full state of a slot, to <state>.delta, until they are more than
+     consolidate_percent of it and the full state is written again. 0, the default, always writes full states */
+  extern void FK_SetSaveStateDeltas(int consolidate_percent);
+
+  /* loads the state saved by EXIT APP, e.g. to resume the game at launch. Returns 0 on success, -1 otherwise */
+  extern int FK_LoadQuickSaveState(void);
+
+  /* to be called from the callbacks only, return 0 on success and -1 on error or past the end of the state */
+  extern int FK_WriteSaveStream(FK_SaveStream* stream, const void* data, size_t size);
+  extern int FK_ReadSaveStream(FK_SaveStream* stream, void* data, size_t size);
+
+  /* packs the loose menu resources into a single bundle at path, or MENU_RESOURCE_BUNDLE in the resource
+     directory if NULL, which next FK_InitMenu maps at once. Returns 0 on success, -1 otherwise */
+  extern int FK_ExportMenuResourceBundle(const char* path);
+
+  typedef int64_t fkmenu_t;
+
+  /* Ends C function definitions when using C++ */
 #ifdef __cplusplus
 }
+
+/* handle based API, each handle is an independent menu keeping its own resources loaded,
+   the functions above work on a default menu */
+
+/* inits a new menu and returns a handle to manage it */
+#ifdef HAS_MENU_THEME
+extern void FK_InitMenu(fkmenu_t& handle, Configuration& c, SDL_Surface* screen);
+#else
+extern void FK_InitMenu(fkmenu_t& handle, SDL_Surface* screen);
+#endif
+
+/* inits a new menu preparing its resources in background */
+#ifdef HAS_MENU_THEME
+extern void FK_InitMenuAsync(fkmenu_t& handle, Configuration& c, SDL_Surface* screen);
+#else
+extern void FK_InitMenuAsync(fkmenu_t& handle, SDL_Surface* screen);
+#endif
+
+/* releases all menu resources and invalidates the handle */
+extern void FK_EndMenu(fkmenu_t& handle);
+
+extern int FK_RunMenu(fkmenu_t handle, SDL_Surface* screen);
+extern void FK_StopMenu(fkmenu_t handle);
+extern int FK_MenuOpenOverlay(fkmenu_t handle, int menu_type);
+extern void FK_MenuCloseOverlay(fkmenu_t handle);
+extern int FK_MenuHandleEvent(fkmenu_t handle, const SDL_Event* event);
+extern int FK_MenuUpdate(fkmenu_t handle);
+extern void FK_MenuComposite(fkmenu_t handle, SDL_Surface* screen);
+extern void FK_SetMenuFPS(fkmenu_t handle, int fps);
+extern void FK_SetMenuFrameCallback(fkmenu_t handle, FK_MenuFrameCallback callback, void* userdata);
+#ifdef HAS_MENU_ASPECT_RATIO
+extern int FK_GetAspectRatio(fkmenu_t handle);
+extern int FK_GetAspectRatioFactor(fkmenu_t handle);
+extern void FK_SetAspectRatio(fkmenu_t handle, int aspect_ratio, int factor_percent);
+#endif
+extern void FK_SetMenuBackground(fkmenu_t handle, SDL_Surface* frame);
+extern void FK_SetMenuSourceFrame(fkmenu_t handle, SDL_Surface* frame);
+extern void FK_SetMenuZoneCache(fkmenu_t handle, const char* path);
+extern void FK_SetMenuZoneBudget(fkmenu_t handle, int max_zones);
+extern void FK_SetMenuSystemStateFreshness(fkmenu_t handle, int ms);
+extern void FK_SetSaveStateService(fkmenu_t handle, const char* path, const FK_SaveStateCallbacks* callbacks);
+extern void FK_SetSaveStateDeltas(fkmenu_t handle, int consolidate_percent);
+extern int FK_LoadQuickSaveState(fkmenu_t handle);
+extern int FK_AddMenuZone(fkmenu_t handle, const FK_MenuZone* zone);
+extern int FK_GetMenuZoneIndex(fkmenu_t handle, int menu_type);
 #endif
 
 #endif /* _FK_menu_h */
\ No newline at end of file
@@ -0,0 +1,367 @@
+/*
+    FK - FunKey retro gaming console library
+    Copyright (C) 2020-2021 Vincent Buso
+    Copyright (C) 2020-2021 Michel Stempin
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Vincent Buso
+    vincent.buso@funkey-project.com
+    Michel Stempin
+    michel.stempin@funkey-project.com
+*/
+
+/**
+ *  @file FK_scaler.c
+ *  This is the frame scaler API for the FunKey retro gaming console library
+ */
+
+#include "scaler.h"
+
+#ifdef HAS_MENU_ASPECT_RATIO
+
+#define SCALER_ERROR
+
+#ifdef SCALER_ERROR
+#define SCALER_ERROR_PRINTF(...)   printf(__VA_ARGS__);
+#else
+#define SCALER_ERROR_PRINTF(...)
+#endif //SCALER_ERROR
+
+#include <vector>
+#include <cstring>
+#include <cstdio>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAS_NEON
+#endif
+
+/// -------------- DEFINES --------------
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+/* bilinear weights are in 1/32 of the second pixel, the precision of the RGB565 red and blue channels */
+#define WEIGHT_BITS                 5
+#define WEIGHT_ONE                  (1 << WEIGHT_BITS)
+
+/// -------------- RGB565 KERNELS --------------
+
+/* spreads the channels of a pixel apart in 32 bits as 00000gggggg00000rrrrr000000bbbbb, leaving each of them
+   room to be multiplied by a weight without overflowing into the next one */
+static inline uint32_t spread(uint16_t pixel)
+{
+  return (pixel | (uint32_t)pixel << 16) & 0x07E0F81F;
+}
+
+static inline uint16_t pack(uint32_t spreaded)
+{
+  spreaded &= 0x07E0F81F;
+  return (uint16_t)(spreaded | spreaded >> 16);
+}
+
+static inline uint16_t blend(uint16_t a, uint16_t b, uint32_t weight)
+{
+  return pack((spread(a) * (WEIGHT_ONE - weight) + spread(b) * weight) >> WEIGHT_BITS);
+}
+
+#ifdef HAS_NEON
+/* same as blend() on 8 pixels at once, channels are split in 16 bits lanes where they fit multiplied by a weight */
+static inline uint16x8_t blend8(uint16x8_t a, uint16x8_t b, uint16x8_t weight)
+{
+  const uint16x8_t mask5 = vdupq_n_u16(0x1F);
+  const uint16x8_t mask6 = vdupq_n_u16(0x3F);
+  uint16x8_t inverse = vsubq_u16(vdupq_n_u16(WEIGHT_ONE), weight);
+
+  uint16x8_t r = vmlaq_u16(vmulq_u16(vshrq_n_u16(a, 11), inverse), vshrq_n_u16(b, 11), weight);
+  uint16x8_t g = vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(a, 5), mask6), inverse), vandq_u16(vshrq_n_u16(b, 5), mask6), weight);
+  uint16x8_t bl = vmlaq_u16(vmulq_u16(vandq_u16(a, mask5), inverse), vandq_u16(b, mask5), weight);
+
+  r = vshlq_n_u16(vshrq_n_u16(r, WEIGHT_BITS), 11);
+  g = vshlq_n_u16(vshrq_n_u16(g, WEIGHT_BITS), 5);
+  bl = vshrq_n_u16(bl, WEIGHT_BITS);
+  return vorrq_u16(vorrq_u16(r, g), bl);
+}
+#endif
+
+/* blends two source rows with the same weight for all pixels */
+static void blendRows(const uint16_t* a, const uint16_t* b, uint16_t* dest, int count, uint16_t weight)
+{
+  int x = 0;
+#ifdef HAS_NEON
+  uint16x8_t weights = vdupq_n_u16(weight);
+  for (; x + 8 <= count; x += 8)
+    vst1q_u16(dest + x, blend8(vld1q_u16(a + x), vld1q_u16(b + x), weights));
+#endif
+  for (; x < count; x++)
+    dest[x] = blend(a[x], b[x], weight);
+}
+
+/* each destination pixel blends two neighbouring source pixels */
+static void blendColumns(const uint16_t* src, uint16_t* dest, int count, const uint16_t* index, const uint16_t* weight)
+{
+  int x = 0;
+#ifdef HAS_NEON
+  /* there is no gather, pixel pairs are loaded one by one and blended 8 at a time */
+  uint16_t left[8], right[8];
+  for (; x + 8 <= count; x += 8)
+  {
+    for (int i = 0; i < 8; i++)
+    {
+      left[i] = src[index[x + i]];
+      right[i] = src[index[x + i] + 1];
+    }
+    vst1q_u16(dest + x, blend8(vld1q_u16(left), vld1q_u16(right), vld1q_u16(weight + x)));
+  }
+#endif
+  for (; x < count; x++)
+    dest[x] = blend(src[index[x]], src[index[x] + 1], weight[x]);
+}
+
+static void gatherColumns(const uint16_t* src, uint16_t* dest, int count, const uint16_t* index)
+{
+  int x = 0;
+  for (; x + 4 <= count; x += 4)
+  {
+    dest[x] = src[index[x]];
+    dest[x + 1] = src[index[x + 1]];
+    dest[x + 2] = src[index[x + 2]];
+    dest[x + 3] = src[index[x + 3]];
+  }
+  for (; x < count; x++)
+    dest[x] = src[index[x]];
+}
+
+/// -------------- SCALER --------------
+
+struct FK_Scaler
+{
+  int srcW, srcH, dstW, dstH;
+  int filter;
+
+  /* tables are built for these, mode is -1 until the first FK_SetScalerMode */
+  int mode;
+  int factor;
+
+  /* part of the destination the frame lands on */
+  int areaX, areaY, areaW, areaH;
+
+  /* for each column and row of the area, source pixel and weight of the next one */
+  std::vector<uint16_t> xIndex, xWeight;
+  std::vector<uint16_t> yIndex, yWeight;
+
+  /* vertically blended source row, bilinear only */
+  std::vector<uint16_t> row;
+
+  FK_Scaler(int srcW, int srcH, int dstW, int dstH, int filter) : srcW(srcW), srcH(srcH), dstW(dstW), dstH(dstH),
+    filter(filter), mode(-1), factor(0), areaX(0), areaY(0), areaW(0), areaH(0), row(srcW) { }
+
+  /* source coordinate sampled by destination pixel i of an axis, tables are computed once per mode so doubles are fine */
+  void buildAxis(std::vector<uint16_t>& index, std::vector<uint16_t>& weight, int count, double start, double scale, int size)
+  {
+    index.resize(count);
+    weight.resize(count);
+
+    for (int i = 0; i < count; i++)
+    {
+      double position = start + (i + 0.5) / scale;
+      if (filter == SCALER_FILTER_NEAREST)
+      {
+        index[i] = (uint16_t)MIN(MAX((int)position, 0), size - 1);
+        weight[i] = 0;
+        continue;
+      }
+
+      /* a pixel covers [n, n + 1), its center is at n + 0.5 */
+      position = MIN(MAX(position - 0.5, 0.0), (double)(size - 1));
+      int n = MIN((int)position, size - 2);
+      index[i] = (uint16_t)n;
+      weight[i] = (uint16_t)MIN((int)((position - n) * WEIGHT_ONE + 0.5), WEIGHT_ONE);
+    }
+  }
+
+  void setMode(int aspectRatio, int factorPercent)
+  {
+    factorPercent = MIN(MAX(factorPercent, 0), 100);
+    if (aspectRatio == mode && (aspectRatio != ASPECT_RATIOS_TYPE_MANUAL || factorPercent == factor))
+      return;
+
+    mode = aspectRatio;
+    factor = factorPercent;
+
+    /// ------ Scale of each axis, uniform unless stretched ------
+    double fit = MIN((double)dstW / srcW, (double)dstH / srcH);
+    double fill = MAX((double)dstW / srcW, (double)dstH / srcH);
+    double scaleX, scaleY;
+    switch (mode)
+    {
+    case ASPECT_RATIOS_TYPE_MANUAL:
+      scaleX = scaleY = fit + (fill - fit) * factor / 100;
+      break;
+    case ASPECT_RATIOS_TYPE_CROPPED:
+      scaleX = scaleY = fill;
+      break;
+    case ASPECT_RATIOS_TYPE_SCALED:
+      scaleX = scaleY = fit;
+      break;
+    case ASPECT_RATIOS_TYPE_STRECHED:
+    default:
+      scaleX = (double)dstW / srcW;
+      scaleY = (double)dstH / srcH;
+      break;
+    }
+
+    /// ------ Scaled frame is centered, cropped where it overflows ------
+    areaW = MIN((int)(srcW * scaleX + 0.5), dstW);
+    areaH = MIN((int)(srcH * scaleY + 0.5), dstH);
+    areaX = (dstW - areaW) / 2;
+    areaY = (dstH - areaH) / 2;
+
+    buildAxis(xIndex, xWeight, areaW, (srcW - areaW / scaleX) / 2, scaleX, srcW);
+    buildAxis(yIndex, yWeight, areaH, (srcH - areaH / scaleY) / 2, scaleY, srcH);
+  }
+
+  void clearBorders(uint16_t* dst, int dstPitch) const
+  {
+    for (int y = 0; y < dstH; y++)
+    {
+      uint16_t* line = reinterpret_cast<uint16_t*>(reinterpret_cast<uint8_t*>(dst) + y * dstPitch);
+      if (y < areaY || y >= areaY + areaH)
+        memset(line, 0, dstW * 2);
+      else
+      {
+        memset(line, 0, areaX * 2);
+        memset(line + areaX + areaW, 0, (dstW - areaX - areaW) * 2);
+      }
+    }
+  }
+
+  void scale(const uint16_t* src, int srcPitch, uint16_t* dst, int dstPitch)
+  {
+    if (mode < 0)
+      setMode(ASPECT_RATIOS_TYPE_STRECHED, 0);
+
+    clearBorders(dst, dstPitch);
+
+    const uint8_t* srcBytes = reinterpret_cast<const uint8_t*>(src);
+    uint8_t* dstBytes = reinterpret_cast<uint8_t*>(dst);
+    const uint16_t* previous = nullptr;
+
+    /* only the source columns sampled are blended vertically */
+    int first = xIndex.empty() ? 0 : xIndex.front();
+    int last = xIndex.empty() ? 0 : MIN(xIndex.back() + (filter == SCALER_FILTER_BILINEAR ? 1 : 0), srcW - 1);
+
+    for (int y = 0; y < areaH; y++)
+    {
+      uint16_t* line = reinterpret_cast<uint16_t*>(dstBytes + (areaY + y) * dstPitch) + areaX;
+
+      /// ------ Rows sampling the same source as the previous one are a copy of it ------
+      if (previous && yIndex[y] == yIndex[y - 1] && yWeight[y] == yWeight[y - 1])
+      {
+        memcpy(line, previous, areaW * 2);
+        previous = line;
+        continue;
+      }
+
+      const uint16_t* top = reinterpret_cast<const uint16_t*>(srcBytes + yIndex[y] * srcPitch);
+      if (filter == SCALER_FILTER_NEAREST)
+        gatherColumns(top, line, areaW, xIndex.data());
+      else
+      {
+        const uint16_t* source = top;
+        if (yWeight[y])
+        {
+          const uint16_t* bottom = reinterpret_cast<const uint16_t*>(srcBytes + (yIndex[y] + 1) * srcPitch);
+          blendRows(top + first, bottom + first, row.data() + first, last - first + 1, yWeight[y]);
+          source = row.data();
+        }
+        blendColumns(source, line, areaW, xIndex.data(), xWeight.data());
+      }
+      previous = line;
+    }
+  }
+};
+
+/// -------------- C API --------------
+
+FK_Scaler* FK_CreateScaler(int src_w, int src_h, int dst_w, int dst_h, int filter)
+{
+  if (src_w < 2 || src_h < 2 || dst_w < 1 || dst_h < 1 || src_w > 0xFFFF || src_h > 0xFFFF || filter < 0 || filter >= NB_SCALER_FILTERS) {
+    SCALER_ERROR_PRINTF("ERROR Invalid scaler from %dx%d to %dx%d\n", src_w, src_h, dst_w, dst_h);
+    return NULL;
+  }
+  return new FK_Scaler(src_w, src_h, dst_w, dst_h, filter);
+}
+
+void FK_FreeScaler(FK_Scaler* scaler)
+{
+  delete scaler;
+}
+
+void FK_SetScalerMode(FK_Scaler* scaler, int aspect_ratio, int factor_percent)
+{
+  if (scaler)
+    scaler->setMode(aspect_ratio, factor_percent);
+}
+
+void FK_ScaleFrame(FK_Scaler* scaler, const uint16_t* src, int src_pitch, uint16_t* dst, int dst_pitch)
+{
+  if (scaler && src && dst)
+    scaler->scale(src, src_pitch, dst, dst_pitch);
+}
+
+static int scale_surface(FK_Scaler* scaler, SDL_Surface* src, SDL_Surface* dst, int aspect_ratio, int factor_percent)
+{
+  if (!scaler || !src || !dst)
+    return -1;
+
+  if (src->format->BitsPerPixel != 16 || dst->format->BitsPerPixel != 16 ||
+    src->w != scaler->srcW || src->h != scaler->srcH || dst->w != scaler->dstW || dst->h != scaler->dstH) {
+    SCALER_ERROR_PRINTF("ERROR Surfaces do not match the scaler\n");
+    return -1;
+  }
+
+  /// ------ Follows the menu right away, tables are only rebuilt on change ------
+  scaler->setMode(aspect_ratio, factor_percent);
+
+  if (SDL_MUSTLOCK(src) && SDL_LockSurface(src) < 0)
+    return -1;
+  if (SDL_MUSTLOCK(dst) && SDL_LockSurface(dst) < 0) {
+    if (SDL_MUSTLOCK(src))
+      SDL_UnlockSurface(src);
+    return -1;
+  }
+
+  scaler->scale(static_cast<const uint16_t*>(src->pixels), src->pitch, static_cast<uint16_t*>(dst->pixels), dst->pitch);
+
+  if (SDL_MUSTLOCK(dst))
+    SDL_UnlockSurface(dst);
+  if (SDL_MUSTLOCK(src))
+    SDL_UnlockSurface(src);
+  return 0;
+}
+
+int FK_ScaleSurface(FK_Scaler* scaler, SDL_Surface* src, SDL_Surface* dst)
+{
+  return scale_surface(scaler, src, dst, FK_GetAspectRatio(), FK_GetAspectRatioFactor());
+}
+
+int FK_ScaleSurface(fkmenu_t handle, FK_Scaler* scaler, SDL_Surface* src, SDL_Surface* dst)
+{
+  return scale_surface(scaler, src, dst, FK_GetAspectRatio(handle), FK_GetAspectRatioFactor(handle));
+}
+
+#endif /* HAS_MENU_ASPECT_RATIO */
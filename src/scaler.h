@@ -0,0 +1,77 @@
+/*
+    FK - FunKey retro gaming console library
+    Copyright (C) 2020-2021 Vincent Buso
+    Copyright (C) 2020-2021 Michel Stempin
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Vincent Buso
+    vincent.buso@funkey-project.com
+    Michel Stempin
+    michel.stempin@funkey-project.com
+*/
+
+/**
+ *  @file FK_scaler.h
+ *  This is the frame scaler API for the FunKey retro gaming console library
+ */
+
+#ifndef _FK_scaler_h
+#define _FK_scaler_h
+
+#include "menu.h"
+
+#ifdef HAS_MENU_ASPECT_RATIO
+
+ /* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  typedef enum {
+    SCALER_FILTER_NEAREST,
+    SCALER_FILTER_BILINEAR,
+    NB_SCALER_FILTERS,
+  } ENUM_SCALER_FILTERS;
+
+  /* scales RGB565 frames of a fixed size to a fixed size screen in one of the ENUM_ASPECT_RATIOS_TYPES modes */
+  typedef struct FK_Scaler FK_Scaler;
+
+  /* returns a scaler from src_w x src_h frames to dst_w x dst_h ones, sources must be at least 2x2. NULL on failure */
+  extern FK_Scaler* FK_CreateScaler(int src_w, int src_h, int dst_w, int dst_h, int filter);
+  extern void FK_FreeScaler(FK_Scaler* scaler);
+
+  /* selects the ENUM_ASPECT_RATIOS_TYPES mode, factor_percent is the zoom of ASPECT_RATIOS_TYPE_MANUAL from
+     0, the frame fits the screen, to 100, it fills it. Coordinate tables are only rebuilt if they changed */
+  extern void FK_SetScalerMode(FK_Scaler* scaler, int aspect_ratio, int factor_percent);
+
+  /* scales one frame in the mode last set, pitches are in bytes. Whatever the frame leaves uncovered is cleared */
+  extern void FK_ScaleFrame(FK_Scaler* scaler, const uint16_t* src, int src_pitch, uint16_t* dst, int dst_pitch);
+
+  /* scales src on dst in the aspect ratio picked in the default menu, to be called once per frame. Both must be 16 bpp
+     and of the sizes the scaler was created for. Returns 0 on success, -1 otherwise */
+  extern int FK_ScaleSurface(FK_Scaler* scaler, SDL_Surface* src, SDL_Surface* dst);
+
+  /* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+
+/* same as above in the aspect ratio picked in the menu of handle */
+extern int FK_ScaleSurface(fkmenu_t handle, FK_Scaler* scaler, SDL_Surface* src, SDL_Surface* dst);
+#endif
+
+#endif /* HAS_MENU_ASPECT_RATIO */
+
+#endif /* _FK_scaler_h */